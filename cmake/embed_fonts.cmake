@@ -0,0 +1,54 @@
+# Compresses fonts with gzip into a generated source with an index, see src/embedded_fonts.h
+#
+#   cmake -DOUTPUT=<file.cpp> -DFONTS=<font|font|...> -P embed_fonts.cmake
+cmake_minimum_required(VERSION 3.21)
+
+string(REPLACE "|" ";" FONTS "${FONTS}")
+get_filename_component(output_dir ${OUTPUT} DIRECTORY)
+file(MAKE_DIRECTORY ${output_dir})
+
+set(arrays "")
+set(entries "")
+foreach (font ${FONTS})
+    get_filename_component(name ${font} NAME)
+    string(MAKE_C_IDENTIFIER ${name} identifier)
+
+    set(compressed ${output_dir}/${name}.gz)
+    file(ARCHIVE_CREATE OUTPUT ${compressed} PATHS ${font} FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
+    file(SIZE ${font} size)
+    file(SIZE ${compressed} compressed_size)
+
+    file(READ ${compressed} hex HEX)
+    file(REMOVE ${compressed})
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+    # no modification time in the gzip header, the output only changes with the fonts
+    string(SUBSTRING "${hex}" 40 -1 hex)
+    string(PREPEND hex "0x1f,0x8b,0x08,0x00,0x00,0x00,0x00,0x00,")
+    # 16 bytes per line
+    string(REPEAT "0x..," 16 line)
+    string(REGEX REPLACE "(${line})" "\\1\n    " hex "${hex}")
+
+    string(APPEND arrays "const unsigned char ${identifier}[] = {\n    ${hex}\n};\n\n")
+    string(APPEND entries "    { \"${name}\", ${identifier}, ${compressed_size}, ${size} },\n")
+    message(STATUS "Embedded ${name}: ${size} -> ${compressed_size} bytes")
+endforeach ()
+
+list(LENGTH FONTS fonts_n)
+file(WRITE ${OUTPUT}.tmp
+"// generated by cmake/embed_fonts.cmake, do not edit
+#include \"embedded_fonts.h\"
+
+namespace embedded_fonts
+{
+namespace
+{
+${arrays}} // namespace
+
+const Entry entries[] = {
+${entries}};
+const size_t entries_n = ${fonts_n};
+} // namespace embedded_fonts
+")
+# keeps the timestamp when nothing changed
+file(COPY_FILE ${OUTPUT}.tmp ${OUTPUT} ONLY_IF_DIFFERENT)
+file(REMOVE ${OUTPUT}.tmp)
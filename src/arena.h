@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+namespace typesetting
+{
+/**
+ * Monotonic arena for short lived storage. Allocations bump a pointer through blocks, deallocations
+ * do nothing, and reset() rewinds to the first block without freeing any. Unlike
+ * std::pmr::monotonic_buffer_resource, whose release() gives the grown blocks back, the blocks are
+ * kept, so once the arena grew to the peak of a workload repeating it doesn't allocate anymore.
+ *
+ * Not thread safe, one arena per thread.
+ */
+struct Arena : std::pmr::memory_resource
+{
+    explicit Arena(size_t first_block_size = 64 * 1024) : next_block_size(first_block_size) {}
+
+    Arena(const Arena&)            = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // everything allocated so far is dead
+    void reset()
+    {
+        used_peak  = std::max(used_peak, used_total);
+        used_total = 0;
+        block_idx  = 0;
+        used       = 0;
+    }
+
+    size_t capacity() const
+    {
+        size_t n = 0;
+        for (const auto& block : blocks)
+            n += block.size;
+        return n;
+    }
+
+    size_t blocks_n() const { return blocks.size(); }
+    size_t peak() const { return std::max(used_peak, used_total); }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        for (;;)
+        {
+            if (block_idx < blocks.size())
+            {
+                auto& block           = blocks[block_idx];
+                const auto base       = reinterpret_cast<uintptr_t>(block.data.get());
+                const auto mask       = ~(uintptr_t) (alignment - 1);
+                const uintptr_t start = (base + used + alignment - 1) & mask;
+                if (start + bytes <= base + block.size)
+                {
+                    used_total += start + bytes - (base + used);
+                    used = start + bytes - base;
+                    return reinterpret_cast<void*>(start);
+                }
+                // the rest of the block is wasted until the next reset
+                if (++block_idx < blocks.size())
+                {
+                    used = 0;
+                    continue;
+                }
+            }
+            // grows geometrically, so a workload settles in a few blocks
+            const size_t size = std::max(next_block_size, bytes + alignment);
+            blocks.push_back({ std::make_unique<std::byte[]>(size), size });
+            next_block_size = size * 2;
+            block_idx       = blocks.size() - 1;
+            used            = 0;
+        }
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    std::vector<Block> blocks;
+    size_t block_idx = 0; // the block allocated from
+    size_t used      = 0; // bytes used of it
+    size_t next_block_size;
+
+    size_t used_total = 0; // since the last reset
+    size_t used_peak  = 0;
+};
+} // namespace typesetting
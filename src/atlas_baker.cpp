@@ -0,0 +1,369 @@
+/**
+ * Offline atlas baker. Rasterizes the SDF glyphs of a font needed for a corpus with all cores,
+ * packs them tallest first and writes an atlas snapshot that TextRenderer::load_snapshot uploads
+ * without any FreeType work at runtime.
+ *
+ *   atlas_baker <font file> <output file> [options]
+ *
+ *   --corpus <file>           utf-8 text to shape, one paragraph per line (repeatable)
+ *   --test-strings            shape the samples of test_strings.h
+ *   --codepoints <first-last> include a codepoint range, e.g. 0x20-0x7e (repeatable)
+ *
+ * Glyphs are rasterized at spec::sdf_glyph_size, which serves all the font sizes of the face.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <hb-ft.h>
+#include <utf8.h>
+
+#include "spec.h"
+#include "atlas_snapshot.h"
+#include "maxrects_binpack.h"
+#include "test_strings.h"
+
+namespace
+{
+struct Options
+{
+    std::string font_file;
+    std::string output_file;
+    std::vector<std::string> corpus;
+    std::vector<std::pair<char32_t, char32_t>> codepoint_ranges;
+};
+
+struct BakedGlyph
+{
+    unsigned int glyph_index = 0;
+    int width                = 0;
+    int height               = 0;
+    int bearing_x            = 0;
+    int bearing_y            = 0;
+    std::vector<uint8_t> pixels;
+    binpack::Rect rect {};
+    int page = -1;
+};
+
+bool parse_options(int argc, char** argv, Options& options)
+{
+    if (argc < 3)
+        return false;
+
+    options.font_file   = argv[1];
+    options.output_file = argv[2];
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value  = i + 1 < argc;
+        if (arg == "--corpus" && has_value)
+        {
+            std::ifstream file(argv[++i]);
+            if (!file)
+            {
+                fprintf(stderr, "can't open corpus: %s\n", argv[i]);
+                return false;
+            }
+            for (std::string line; std::getline(file, line);)
+                if (!line.empty())
+                    options.corpus.push_back(line);
+        }
+        else if (arg == "--test-strings")
+        {
+            for (auto* str : { test::lorem::latin,     test::lorem::arabian,  test::lorem::korean,
+                               test::lorem::greek,     test::lorem::japanese, test::lorem::russian,
+                               test::lorem::chinese,   test::lorem::indian,   test::lorem::armenian,
+                               test::lorem::hebrew,    test::lorem::thai,     test::adhoc::mixed_cstr,
+                               test::adhoc::emojis,    test::adhoc::all_part1 })
+                options.corpus.emplace_back(str);
+        }
+        else if (arg == "--codepoints" && has_value)
+        {
+            char* end;
+            auto first = (char32_t) strtoul(argv[++i], &end, 0);
+            auto last  = *end == '-' ? (char32_t) strtoul(end + 1, nullptr, 0) : first;
+            if (last < first)
+                return false;
+            options.codepoint_ranges.emplace_back(first, last);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool open_face(FT_Library library, const Options& options, FT_Face& face)
+{
+    if (FT_New_Face(library, options.font_file.c_str(), 0, &face))
+        return false;
+
+    // same size as the glyphs rasterized by TextRenderer::cached_glyph
+    FT_Set_Pixel_Sizes(face, 0, spec::sdf_glyph_size);
+    return true;
+}
+
+// glyph indices of the shaped corpus and the codepoint ranges
+std::vector<unsigned int> collect_glyphs(FT_Face face, const Options& options)
+{
+    std::vector<unsigned int> glyph_indices;
+
+    hb_font_t* font     = hb_ft_font_create_referenced(face);
+    hb_buffer_t* buffer = hb_buffer_create();
+    for (auto& text : options.corpus)
+    {
+        hb_buffer_reset(buffer);
+        hb_buffer_add_utf8(buffer, text.c_str(), (int) text.size(), 0, -1);
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(font, buffer, nullptr, 0);
+
+        unsigned int glyphs_n = 0;
+        const auto* infos     = hb_buffer_get_glyph_infos(buffer, &glyphs_n);
+        for (unsigned int i = 0; i < glyphs_n; ++i)
+            if (infos[i].codepoint != 0)
+                glyph_indices.push_back(infos[i].codepoint);
+    }
+    hb_buffer_destroy(buffer);
+    hb_font_destroy(font);
+
+    for (auto [first, last] : options.codepoint_ranges)
+        for (char32_t c = first; c <= last; ++c)
+            if (auto glyph_index = FT_Get_Char_Index(face, c))
+                glyph_indices.push_back(glyph_index);
+
+    std::sort(glyph_indices.begin(), glyph_indices.end());
+    glyph_indices.erase(std::unique(glyph_indices.begin(), glyph_indices.end()), glyph_indices.end());
+
+    return glyph_indices;
+}
+
+// FreeType faces aren't thread safe, so each worker opens its own library and face
+bool rasterize(const Options& options, std::vector<BakedGlyph>& glyphs)
+{
+    std::atomic<size_t> next { 0 };
+    std::atomic<bool> failed { false };
+
+    auto worker = [&]
+    {
+        FT_Library library;
+        if (FT_Init_FreeType(&library))
+        {
+            failed = true;
+            return;
+        }
+
+        FT_Face face;
+        if (!open_face(library, options, face))
+        {
+            failed = true;
+            FT_Done_FreeType(library);
+            return;
+        }
+
+        for (size_t i = next++; i < glyphs.size() && !failed; i = next++)
+        {
+            auto& glyph = glyphs[i];
+            if (FT_Load_Glyph(face, glyph.glyph_index, FT_LOAD_DEFAULT)
+                || FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF))
+            {
+                fprintf(stderr, "Glyph render failed at: %u\n", glyph.glyph_index);
+                failed = true;
+                break;
+            }
+
+            const auto& bitmap = face->glyph->bitmap;
+            glyph.width        = (int) bitmap.width;
+            glyph.height       = (int) bitmap.rows;
+            glyph.bearing_x    = face->glyph->bitmap_left;
+            glyph.bearing_y    = face->glyph->bitmap_top;
+            glyph.pixels.resize(glyph.width * glyph.height);
+            for (int row = 0; row < glyph.height; ++row)
+                memcpy(glyph.pixels.data() + row * glyph.width, bitmap.buffer + row * bitmap.pitch, glyph.width);
+        }
+
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+    };
+
+    const auto threads_n = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < threads_n; ++i)
+        threads.emplace_back(worker);
+    for (auto& thread : threads)
+        thread.join();
+
+    return !failed;
+}
+
+// Offline the whole set is known, so pack tallest first for dense rows and few pages
+std::vector<binpack::MaxRectsBinPack> pack(std::vector<BakedGlyph>& glyphs)
+{
+    std::vector<BakedGlyph*> order;
+    for (auto& glyph : glyphs)
+        if (glyph.width > 0 && glyph.height > 0)
+            order.push_back(&glyph);
+
+    std::sort(
+        order.begin(),
+        order.end(),
+        [](auto* lhs, auto* rhs)
+        { return lhs->height != rhs->height ? lhs->height > rhs->height : lhs->width > rhs->width; }
+    );
+
+    std::vector<binpack::MaxRectsBinPack> pages;
+    for (auto* glyph : order)
+    {
+        for (size_t i = 0; i <= pages.size() && glyph->page < 0; ++i)
+        {
+            if (i == pages.size())
+                pages.emplace_back(spec::atlas_texture_w, spec::atlas_texture_h);
+
+            auto rect = pages[i].insert(
+                glyph->width,
+                glyph->height,
+                binpack::MaxRectsBinPack::FreeRectChoiceHeuristic::BottomLeft
+            );
+            if (rect.height > 0)
+            {
+                glyph->rect = rect;
+                glyph->page = (int) i;
+            }
+            else if (i + 1 == pages.size() && pages[i].used_area() == 0)
+            {
+                fprintf(stderr, "glyph %u doesn't fit an empty page\n", glyph->glyph_index);
+                break;
+            }
+        }
+    }
+
+    return pages;
+}
+
+bool write_snapshot(const Options& options, uint64_t font_hash, std::vector<BakedGlyph>& glyphs)
+{
+    auto pages = pack(glyphs);
+
+    typesetting::snapshot::Contents contents;
+    contents.atlas_w     = spec::atlas_texture_w;
+    contents.atlas_h     = spec::atlas_texture_h;
+    contents.font_hashes = { font_hash };
+
+    std::vector<std::vector<uint8_t>> pixels(pages.size());
+    std::vector<uint32_t> rows(pages.size(), 0);
+    for (auto& glyph : glyphs)
+    {
+        if (glyph.width > 0 && glyph.height > 0 && glyph.page < 0)
+            continue;
+
+        typesetting::snapshot::GlyphEntry entry {};
+        entry.font        = 0;
+        entry.glyph_index = glyph.glyph_index;
+        entry.size_x      = glyph.width;
+        entry.size_y      = glyph.height;
+        entry.bearing_x   = glyph.bearing_x;
+        entry.bearing_y   = glyph.bearing_y;
+        entry.tex_x       = glyph.rect.x;
+        entry.tex_y       = glyph.rect.y;
+        entry.tex_index   = glyph.page;
+        contents.glyphs.push_back(entry);
+
+        if (glyph.page < 0)
+            continue;
+
+        auto& page_pixels = pixels[glyph.page];
+        page_pixels.resize(spec::atlas_texture_w * spec::atlas_texture_h);
+        for (int row = 0; row < glyph.height; ++row)
+            memcpy(
+                page_pixels.data() + (glyph.rect.y + row) * spec::atlas_texture_w + glyph.rect.x,
+                glyph.pixels.data() + row * glyph.width,
+                glyph.width
+            );
+        rows[glyph.page] = std::max(rows[glyph.page], (uint32_t) (glyph.rect.y + glyph.height));
+    }
+
+    for (size_t i = 0; i < pages.size(); ++i)
+    {
+        const auto& free_rects = pages[i].free_rects();
+
+        typesetting::snapshot::Page page {};
+        page.free_rects_start = (uint32_t) contents.free_rects.size();
+        page.free_rects_n     = (uint32_t) free_rects.size();
+        page.used_area        = pages[i].used_area();
+        page.pixel_rows       = rows[i];
+        contents.pages.push_back(page);
+        contents.pixels.push_back(pixels[i].data());
+        contents.free_rects.insert(contents.free_rects.end(), free_rects.begin(), free_rects.end());
+
+        fprintf(stdout, "page %zu: %.1f%% occupancy, %u rows\n", i, pages[i].occupancy() * 100.f, rows[i]);
+    }
+
+    return typesetting::snapshot::write(options.output_file.c_str(), contents);
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        fprintf(
+            stderr,
+            "usage: atlas_baker <font file> <output file> [--corpus <file>]... "
+            "[--test-strings] [--codepoints <first-last>]...\n"
+        );
+        return 1;
+    }
+
+    using Clock     = std::chrono::steady_clock;
+    const auto then = Clock::now();
+
+    FT_Library library;
+    FT_Face face;
+    if (FT_Init_FreeType(&library) || !open_face(library, options, face))
+    {
+        fprintf(stderr, "can't open font: %s\n", options.font_file.c_str());
+        return 1;
+    }
+
+    const auto font_hash     = typesetting::snapshot::font_hash(face);
+    const auto glyph_indices = collect_glyphs(face, options);
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+
+    std::vector<BakedGlyph> glyphs(glyph_indices.size());
+    for (size_t i = 0; i < glyph_indices.size(); ++i)
+        glyphs[i].glyph_index = glyph_indices[i];
+
+    if (!rasterize(options, glyphs))
+        return 1;
+
+    if (!write_snapshot(options, font_hash, glyphs))
+    {
+        fprintf(stderr, "writing %s failed\n", options.output_file.c_str());
+        return 1;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - then);
+    fprintf(
+        stdout,
+        "baked %zu glyphs of %s at %d into %s in %lld ms\n",
+        glyphs.size(),
+        options.font_file.c_str(),
+        spec::sdf_glyph_size,
+        options.output_file.c_str(),
+        (long long) elapsed.count()
+    );
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_TRUETYPE_TABLES_H
+
+#include "maxrects_binpack.h"
+
+/**
+ * Prebaked atlas binary. The sections are plain arrays laid back to back so that the file can be
+ * used straight from a memory mapping without parsing:
+ *
+ *   Header | font hashes | pages | glyphs | free rects | page pixels
+ *
+ * Glyphs refer to faces by index to the font hashes, which identify a face independent of the
+ * run (Font::face_id is generated at runtime) and of the font size, as the glyphs are rasterized at
+ * spec::sdf_glyph_size. Page pixels are 16 byte aligned atlas_w * pixel_rows
+ * bytes, the rows below are empty (offline packed pages are rarely full).
+ */
+namespace typesetting
+{
+namespace snapshot
+{
+constexpr uint32_t magic   = 0x53414646; // "FFAS"
+constexpr uint32_t version = 4;
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t atlas_w;
+    uint32_t atlas_h;
+    uint32_t fonts_n;
+    uint32_t pages_n;
+    uint32_t glyphs_n;
+    uint32_t free_rects_n;
+};
+
+struct Page
+{
+    uint32_t free_rects_start; // index of the first free rect of this page
+    uint32_t free_rects_n;
+    uint64_t used_area;
+    uint64_t pixels_offset; // from the beginning of the file
+    uint32_t pixel_rows;
+    uint32_t reserved;
+};
+
+struct GlyphEntry
+{
+    uint32_t font; // index to the font hashes
+    uint32_t glyph_index;
+    int32_t size_x;
+    int32_t size_y;
+    int32_t bearing_x;
+    int32_t bearing_y;
+    int32_t tex_x;
+    int32_t tex_y;
+    int32_t tex_index;
+};
+
+// Gathered state of the atlases to be written to a file
+struct Contents
+{
+    uint32_t atlas_w = 0;
+    uint32_t atlas_h = 0;
+    std::vector<uint64_t> font_hashes;
+    std::vector<Page> pages; // pixels offsets are resolved when writing, rows default to atlas_h
+    std::vector<GlyphEntry> glyphs;
+    std::vector<binpack::Rect> free_rects;
+    std::vector<const uint8_t*> pixels; // one per page
+};
+
+// Typed pointers to the sections of a mapped snapshot
+struct View
+{
+    const uint8_t* base             = nullptr;
+    const Header* header            = nullptr;
+    const uint64_t* font_hashes     = nullptr;
+    const Page* pages               = nullptr;
+    const GlyphEntry* glyphs        = nullptr;
+    const binpack::Rect* free_rects = nullptr;
+
+    const uint8_t* pixels(const Page& page) const { return base + page.pixels_offset; }
+};
+
+inline size_t align_up(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+inline size_t sections_size(const Header& h)
+{
+    return sizeof(Header) + h.fonts_n * sizeof(uint64_t) + h.pages_n * sizeof(Page)
+         + h.glyphs_n * sizeof(GlyphEntry) + h.free_rects_n * sizeof(binpack::Rect);
+}
+
+inline bool write(const char* path, Contents& contents)
+{
+    assert(contents.pages.size() == contents.pixels.size());
+
+    Header header;
+    header.magic        = magic;
+    header.version      = version;
+    header.atlas_w      = contents.atlas_w;
+    header.atlas_h      = contents.atlas_h;
+    header.fonts_n      = (uint32_t) contents.font_hashes.size();
+    header.pages_n      = (uint32_t) contents.pages.size();
+    header.glyphs_n     = (uint32_t) contents.glyphs.size();
+    header.free_rects_n = (uint32_t) contents.free_rects.size();
+
+    size_t offset = align_up(sections_size(header), 16);
+    for (auto& page : contents.pages)
+    {
+        if (page.pixel_rows == 0 || page.pixel_rows > header.atlas_h)
+            page.pixel_rows = header.atlas_h;
+        page.pixels_offset = offset;
+        offset             = align_up(offset + (size_t) header.atlas_w * page.pixel_rows, 16);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    auto write_array = [&](const void* ptr, size_t size)
+    { return size == 0 || fwrite(ptr, size, 1, file) == 1; };
+
+    bool ok = write_array(&header, sizeof(header))
+           && write_array(contents.font_hashes.data(), contents.font_hashes.size() * sizeof(uint64_t))
+           && write_array(contents.pages.data(), contents.pages.size() * sizeof(Page))
+           && write_array(contents.glyphs.data(), contents.glyphs.size() * sizeof(GlyphEntry))
+           && write_array(contents.free_rects.data(), contents.free_rects.size() * sizeof(binpack::Rect));
+
+    static const uint8_t padding[16] {};
+    size_t written = sections_size(header);
+    for (size_t i = 0; ok && i < contents.pages.size(); ++i)
+    {
+        const size_t page_size = (size_t) header.atlas_w * contents.pages[i].pixel_rows;
+        ok = write_array(padding, contents.pages[i].pixels_offset - written)
+          && write_array(contents.pixels[i], page_size);
+        written = contents.pages[i].pixels_offset + page_size;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// the rect lies within the atlas, in 64 bits so that no offset or size wraps around
+inline bool within_atlas(int64_t x, int64_t y, int64_t w, int64_t h, const Header& header)
+{
+    return x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= header.atlas_w && y + h <= header.atlas_h;
+}
+
+// Validates the snapshot (mapped from a file or embedded) and points the view to its sections
+inline bool parse(const uint8_t* data, size_t size, View& view)
+{
+    if (!data || size < sizeof(Header))
+        return false;
+
+    const auto* header = (const Header*) data;
+    if (header->magic != magic || header->version != version)
+        return false;
+
+    if (size < sections_size(*header))
+        return false;
+
+    view.base        = data;
+    view.header      = header;
+    view.font_hashes = (const uint64_t*) (header + 1);
+    view.pages       = (const Page*) (view.font_hashes + header->fonts_n);
+    view.glyphs      = (const GlyphEntry*) (view.pages + header->pages_n);
+    view.free_rects  = (const binpack::Rect*) (view.glyphs + header->glyphs_n);
+
+    for (uint32_t i = 0; i < header->pages_n; ++i)
+    {
+        const auto& page = view.pages[i];
+        // pixels lie after the sections and within the file, compared without wrapping around
+        if (page.pixel_rows > header->atlas_h
+            || page.pixels_offset < sections_size(*header) || page.pixels_offset > size
+            || (uint64_t) header->atlas_w * page.pixel_rows > size - page.pixels_offset
+            || (uint64_t) page.free_rects_start + page.free_rects_n > header->free_rects_n)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->glyphs_n; ++i)
+    {
+        const auto& glyph = view.glyphs[i];
+        if (glyph.font >= header->fonts_n || glyph.tex_index >= (int32_t) header->pages_n)
+            return false;
+        // glyphs without pixels have no region
+        if (glyph.tex_index >= 0
+            && !within_atlas(glyph.tex_x, glyph.tex_y, glyph.size_x, glyph.size_y, *header))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->free_rects_n; ++i)
+    {
+        const auto& rect = view.free_rects[i];
+        if (!within_atlas(rect.x, rect.y, rect.width, rect.height, *header))
+            return false;
+    }
+
+    return true;
+}
+
+// FNV-1a over the properties identifying a face, independent of its size. The names and counts
+// alone are the same for revisions of a font, so for sfnt fonts the head table's revision and
+// checksum adjustment (a checksum of the whole file) and the table directory are hashed too.
+inline uint64_t font_hash(FT_Face face)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix      = [&hash](const void* ptr, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= ((const uint8_t*) ptr)[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+
+    if (face->family_name)
+        mix(face->family_name, strlen(face->family_name));
+    if (face->style_name)
+        mix(face->style_name, strlen(face->style_name));
+
+    const int64_t properties[] = {
+        face->num_glyphs, face->units_per_EM, face->face_flags, face->face_index
+    };
+    mix(properties, sizeof(properties));
+
+    if (const auto* head = (const TT_Header*) FT_Get_Sfnt_Table(face, FT_SFNT_HEAD))
+    {
+        const int64_t revision[] = { head->Font_Revision, head->CheckSum_Adjust };
+        mix(revision, sizeof(revision));
+    }
+
+    FT_ULong tables_n = 0;
+    if (FT_Sfnt_Table_Info(face, 0, nullptr, &tables_n) == 0)
+    {
+        for (FT_UInt i = 0; i < tables_n; ++i)
+        {
+            FT_ULong tag = 0, length = 0;
+            if (FT_Sfnt_Table_Info(face, i, &tag, &length) != 0)
+                continue;
+            const uint64_t table[] = { tag, length };
+            mix(table, sizeof(table));
+        }
+    }
+
+    return hash;
+}
+} // namespace snapshot
+} // namespace typesetting
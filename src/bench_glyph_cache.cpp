@@ -0,0 +1,205 @@
+/**
+ * Glyph cache benchmark: hit throughput of ConcurrentCache with a growing number of reader
+ * threads, next to an unordered_map behind a shared_mutex, and a check that concurrent misses of
+ * the same keys create each value once.
+ *
+ *   bench_glyph_cache [lookups per thread] [max threads]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrent_cache.h"
+
+using namespace typesetting;
+
+namespace
+{
+using Key = std::pair<unsigned int, unsigned int>; // face id, glyph index like GlyphKey
+
+// the size of a cached Glyph
+struct Value
+{
+    int size[2];
+    int bearing[2];
+    int tex_offset[2];
+    float uv[4];
+    int tex_index;
+    unsigned int dyn_tex;
+};
+
+struct KeyHash
+{
+    size_t operator()(const Key& key) const { return (size_t) key.first << 32 | key.second; }
+};
+
+using Cache = ConcurrentCache<Key, Value, KeyHash>;
+
+constexpr unsigned int faces_n  = 8;
+constexpr unsigned int glyphs_n = 512; // per face, a few pages of text
+
+struct LockedMap
+{
+    std::optional<Value> find(const Key& key)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto iter = map.find(key);
+        if (iter == map.end())
+            return std::nullopt;
+        return iter->second;
+    }
+
+    std::shared_mutex mutex;
+    std::unordered_map<Key, Value, KeyHash> map;
+};
+
+Value make_value(const Key& key)
+{
+    Value v {};
+    v.size[0]   = (int) key.second;
+    v.tex_index = (int) key.first;
+    return v;
+}
+
+std::vector<Key> lookup_sequence(size_t n, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<unsigned int> face(0, faces_n - 1), glyph(0, glyphs_n - 1);
+    std::vector<Key> keys(n);
+    for (auto& key : keys)
+        key = { face(rng), glyph(rng) };
+    return keys;
+}
+
+// millions of lookups per second of all the threads
+template <typename Find>
+double hit_throughput(int threads_n, size_t lookups, Find&& find)
+{
+    std::vector<std::vector<Key>> sequences;
+    for (int t = 0; t < threads_n; ++t)
+        sequences.push_back(lookup_sequence(lookups, (unsigned int) t + 1));
+
+    std::atomic<int> ready { 0 };
+    std::atomic<bool> go { false };
+    std::atomic<uint64_t> checksum { 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_n; ++t)
+    {
+        threads.emplace_back(
+            [&, t]
+            {
+                ready++;
+                while (!go.load(std::memory_order_acquire))
+                    ;
+                uint64_t sum = 0;
+                for (const auto& key : sequences[t])
+                    if (auto v = find(key))
+                        sum += v->size[0];
+                checksum += sum;
+            }
+        );
+    }
+
+    using Clock = std::chrono::steady_clock;
+    while (ready.load() < threads_n)
+        ;
+    const auto then = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads)
+        thread.join();
+    const std::chrono::duration<double> elapsed = Clock::now() - then;
+
+    if (checksum.load() == 0)
+        fprintf(stderr, "no hits\n");
+    return (double) lookups * threads_n / elapsed.count() / 1e6;
+}
+
+// threads missing the same keys at once, each value has to be created once
+bool creates_once(int threads_n)
+{
+    Cache cache;
+    std::atomic<int> creations { 0 };
+    std::atomic<bool> go { false };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_n; ++t)
+    {
+        threads.emplace_back(
+            [&, t]
+            {
+                while (!go.load(std::memory_order_acquire))
+                    ;
+                auto keys = lookup_sequence(faces_n * glyphs_n, (unsigned int) t + 100);
+                for (const auto& key : keys)
+                {
+                    auto v = cache.get_or_create(
+                        key,
+                        [&]
+                        {
+                            creations++;
+                            // rasterizing takes a while, others miss the key meanwhile
+                            std::this_thread::yield();
+                            return make_value(key);
+                        }
+                    );
+                    if (v.size[0] != (int) key.second)
+                        creations += 1 << 20;
+                }
+            }
+        );
+    }
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads)
+        thread.join();
+
+    fprintf(
+        stdout,
+        "%d threads missing the same keys: %zu keys, %d creations\n",
+        threads_n,
+        cache.size(),
+        creations.load()
+    );
+    return creations.load() == (int) cache.size();
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t lookups   = argc > 1 ? (size_t) atoll(argv[1]) : 4'000'000;
+    const int max_threads  = argc > 2 ? atoi(argv[2]) : (int) std::max(1u, std::thread::hardware_concurrency());
+
+    Cache cache;
+    LockedMap locked;
+    for (unsigned int f = 0; f < faces_n; ++f)
+    {
+        for (unsigned int g = 0; g < glyphs_n; ++g)
+        {
+            cache.insert_or_assign({ f, g }, make_value({ f, g }));
+            locked.map[{ f, g }] = make_value({ f, g });
+        }
+    }
+
+    fprintf(stdout, "hits, %zu lookups per thread (M lookups/s)\n", lookups);
+    fprintf(stdout, "%-8s %12s %8s %14s %8s\n", "threads", "concurrent", "scaling", "shared_mutex", "scaling");
+    double cache_1 = 0, locked_1 = 0;
+    for (int threads_n = 1; threads_n <= max_threads; threads_n *= 2)
+    {
+        const double c = hit_throughput(threads_n, lookups, [&](const Key& key) { return cache.find(key, 1); });
+        const double l = hit_throughput(threads_n, lookups, [&](const Key& key) { return locked.find(key); });
+        if (threads_n == 1)
+        {
+            cache_1  = c;
+            locked_1 = l;
+        }
+        fprintf(stdout, "%-8d %12.1f %7.2fx %14.1f %7.2fx\n", threads_n, c, c / cache_1, l, l / locked_1);
+    }
+
+    return creates_once(std::max(2, max_threads)) ? 0 : 2;
+}
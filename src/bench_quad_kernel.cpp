@@ -0,0 +1,136 @@
+/**
+ * Microbenchmark of the quad emission stage alone: glyphs per second written by each kernel the
+ * build supports, from a batch resolved beforehand. The SIMD kernels are checked against the
+ * scalar one first.
+ *
+ *   bench_quad_kernel [glyphs]
+ */
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "quad_kernel.h"
+
+using namespace typesetting;
+
+namespace
+{
+using Kernel = void (*)(const kernel::QuadBatch&, size_t, size_t, float, float*);
+
+void fill(kernel::QuadBatch& b, std::mt19937& rng)
+{
+    std::uniform_int_distribution<int> advance(4, 40), offset(-256, 256), metric(0, 48);
+    std::uniform_real_distribution<float> uv(0.0f, 1.0f);
+
+    float pen = 0.5f;
+    b.n     = kernel::batch_capacity;
+    for (size_t i = 0; i < b.n; ++i)
+    {
+        b.pen_x[i]     = pen;
+        b.pen_y[i]     = 300;
+        b.offset_x[i]  = offset(rng);
+        b.offset_y[i]  = offset(rng);
+        b.bearing_x[i] = (float) metric(rng) - 8.0f;
+        b.descent[i]   = (float) metric(rng) / 4.0f;
+        b.w[i]         = (float) metric(rng);
+        b.h[i]         = (float) metric(rng);
+        b.u0[i]        = uv(rng);
+        b.v0[i]        = uv(rng);
+        b.u1[i]        = b.u0[i] + 1.0f / 64.0f;
+        b.v1[i]        = b.v0[i] + 1.0f / 64.0f;
+        b.tex_x[i]     = 0;
+        b.tex_y[i]     = 0;
+        b.layer[i]     = 0;
+        pen += advance(rng);
+    }
+}
+
+bool matches(const kernel::QuadBatch& b, Kernel k, const char* name)
+{
+    std::vector<float> expected(b.n * kernel::floats_per_glyph), actual(expected.size());
+    kernel::emit_triangles_scalar(b, 0, b.n, 0.75f, expected.data());
+    // an odd range to cover the scalar tail
+    k(b, 0, b.n - 3, 0.75f, actual.data());
+    k(b, b.n - 3, b.n, 0.75f, actual.data() + (b.n - 3) * kernel::floats_per_glyph);
+
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        // fused multiply adds round once
+        if (std::fabs(expected[i] - actual[i]) > 1e-3f)
+        {
+            fprintf(stderr, "%s differs at glyph %zu: %f != %f\n", name, i / kernel::floats_per_glyph, actual[i], expected[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+double glyphs_per_second(const std::vector<kernel::QuadBatch>& batches, Kernel k, size_t glyphs_n)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<float> out(kernel::batch_capacity * kernel::floats_per_glyph);
+    volatile float sink = 0;
+
+    const auto then = Clock::now();
+    size_t emitted  = 0;
+    while (emitted < glyphs_n)
+    {
+        for (auto& b : batches)
+        {
+            k(b, 0, b.n, 0.75f, out.data());
+            sink     = sink + out[emitted % out.size()];
+            emitted += b.n;
+        }
+    }
+    const std::chrono::duration<double> elapsed = Clock::now() - then;
+
+    return emitted / elapsed.count();
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t glyphs_n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 50'000'000;
+
+    // a working set of batches that fits the caches, like the glyphs of a screen
+    std::mt19937 rng(42);
+    std::vector<kernel::QuadBatch> batches(16);
+    for (auto& b : batches)
+        fill(b, rng);
+
+    struct Candidate
+    {
+        const char* name;
+        Kernel kernel;
+    };
+    std::vector<Candidate> candidates = { { "scalar", &kernel::emit_triangles_scalar } };
+#if QUAD_KERNEL_SSE2
+    candidates.push_back({ "sse2", &kernel::emit_triangles_sse2 });
+#endif
+#if QUAD_KERNEL_AVX2
+    candidates.push_back({ "avx2", &kernel::emit_triangles_avx2 });
+#endif
+#if QUAD_KERNEL_NEON
+    candidates.push_back({ "neon", &kernel::emit_triangles_neon });
+#endif
+
+    for (auto& c : candidates)
+        if (!matches(batches[0], c.kernel, c.name))
+            return 1;
+
+    fprintf(stdout, "quad emission, %zu glyphs, default kernel: %s\n", glyphs_n, kernel::emit_triangles_isa());
+    double scalar_rate = 0;
+    for (auto& c : candidates)
+    {
+        const double rate = glyphs_per_second(batches, c.kernel, glyphs_n);
+        if (scalar_rate == 0)
+            scalar_rate = rate;
+        fprintf(stdout, "%-8s %8.1f M glyphs/s (%.2fx)\n", c.name, rate / 1e6, rate / scalar_rate);
+    }
+
+    return 0;
+}
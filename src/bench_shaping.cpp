@@ -0,0 +1,430 @@
+/**
+ * Shaping benchmark: itemizes and shapes each script of test_strings.h with the FreeType and the
+ * OpenType font functions of harfbuzz, timing both and checking that they agree on the glyphs
+ * and their positions. Then shapes the whole corpus again into an arena rewound every pass, and
+ * counts the allocations through the global operator new once the arenas have grown, which
+ * should be none. With glibc, malloc and free are interposed and counted too: SheenBidi creates
+ * and releases its algorithm, paragraph, line and script locator objects on every call, and
+ * harfbuzz allocates some of its own, so those are reported but not failed on. Elsewhere only the
+ * C++ allocations are counted.
+ *
+ * The first column is the first shaping of the script, with the shape plans of the mapped scripts
+ * compiled when the fonts were set up, unless --no-warm-up leaves that to the first shaping.
+ *
+ * Last, ASCII labels are shaped in the simple mode and checked against harfbuzz with the
+ * ligatures off, with and without kerning.
+ *
+ *   bench_shaping [iterations] [--no-warm-up]
+ */
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "text.h"
+#include "test_strings.h"
+
+using namespace typesetting;
+
+namespace
+{
+std::atomic<uint64_t> heap_allocations_n { 0 };
+std::atomic<uint64_t> malloc_calls_n { 0 }; // of C code, operator new isn't counted twice
+std::atomic<uint64_t> free_calls_n { 0 };
+} // namespace
+
+#if defined(__GLIBC__)
+#define FONT_FRONT_COUNTS_MALLOC 1
+
+// glibc's own entry points, the definitions below take the place of the public ones
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    malloc_calls_n.fetch_add(1, std::memory_order_relaxed);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void* ptr) noexcept
+{
+    if (ptr)
+        free_calls_n.fetch_add(1, std::memory_order_relaxed);
+    __libc_free(ptr);
+}
+}
+
+static void* raw_malloc(size_t size) { return __libc_malloc(size); }
+static void raw_free(void* ptr) { __libc_free(ptr); }
+#else
+#define FONT_FRONT_COUNTS_MALLOC 0
+
+static void* raw_malloc(size_t size) { return std::malloc(size); }
+static void raw_free(void* ptr) { std::free(ptr); }
+#endif
+
+void* operator new(size_t size)
+{
+    heap_allocations_n.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = raw_malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { raw_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { raw_free(ptr); }
+
+namespace
+{
+struct FontSet
+{
+    std::vector<std::unique_ptr<FontHandle>> fonts;
+    Font::Map map;
+
+    // created up front, to time the shaping alone
+    FontHandle* add(Library& library, const char* file, FontFuncs funcs)
+    {
+        const std::string path = std::string(FONTS_DIR) + "/" + file;
+        auto& handle           = fonts.emplace_back(std::make_unique<FontHandle>(FontHandle::file(&library, path, 32, 1.0f, funcs)));
+        if (!handle->get())
+            exit(1);
+        return handle.get();
+    }
+
+    bool init(Library& library, FontFuncs funcs, bool warm_up)
+    {
+        using V    = std::vector<FontHandle*>;
+        auto* sans = add(library, "NotoSans-Regular.ttf", funcs);
+        map.add(HB_SCRIPT_LATIN, V { sans });
+        map.add(HB_SCRIPT_GREEK, V { sans });
+        map.add(HB_SCRIPT_CYRILLIC, V { sans });
+        map.add(HB_SCRIPT_ARABIC, V { add(library, "NotoSansArabic-Regular.ttf", funcs) });
+        map.add(HB_SCRIPT_DEVANAGARI, V { add(library, "Sanskrit2003.ttf", funcs) });
+        map.add(HB_SCRIPT_THAI, V { add(library, "Sarabun-Regular.ttf", funcs) });
+        // the rest, CJK included, shape to whatever the last fallback has
+        map.set_fallback(
+            V { add(library, "NotoEmoji-VariableFont_wght.ttf", funcs),
+                add(library, "NotoSansMath-Regular.ttf", funcs),
+                add(library, "DejaVuSerif.ttf", funcs) }
+        );
+        if (warm_up)
+            map.warm_up_shape_plans();
+        return true;
+    }
+
+    void destroy()
+    {
+        for (auto& font : fonts)
+            font->destroy();
+        fonts.clear();
+    }
+};
+
+double shape_us(
+    std::string& text,
+    Font::Map& fonts,
+    int iterations,
+    const ShapingOptions& options = {}
+)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const auto then = Clock::now();
+    for (int i = 0; i < iterations; ++i)
+        create_shapers_in(text, fonts, std::pmr::get_default_resource(), options);
+    const std::chrono::duration<double, std::micro> elapsed = Clock::now() - then;
+
+    return elapsed.count() / iterations;
+}
+
+struct Comparison
+{
+    bool same_glyphs  = true;
+    int max_pos_delta = 0; // in 26.6
+};
+
+Comparison compare(const ShaperRun& a, const ShaperRun& b)
+{
+    Comparison c;
+    if (a.items.size() != b.items.size() || a.total_glyphs_n != b.total_glyphs_n)
+        return { false, 0 };
+
+    for (size_t i = 0; i < a.items.size(); ++i)
+    {
+        const auto& ia = a.items[i];
+        const auto& ib = b.items[i];
+        if (ia.hb_info.size() != ib.hb_info.size())
+            return { false, 0 };
+        for (size_t g = 0; g < ia.hb_info.size(); ++g)
+        {
+            c.same_glyphs = c.same_glyphs && ia.hb_info[g].codepoint == ib.hb_info[g].codepoint;
+
+            const auto& pa = ia.positions[g];
+            const auto& pb = ib.positions[g];
+            for (int delta :
+                 { pa.x_advance - pb.x_advance, pa.y_advance - pb.y_advance, pa.x_offset - pb.x_offset, pa.y_offset - pb.y_offset })
+                c.max_pos_delta = std::max(c.max_pos_delta, std::abs(delta));
+        }
+    }
+    return c;
+}
+
+// simple shaping of UI text next to harfbuzz without ligatures, true if they agree exactly
+bool simple_conforms(Font::Map& fonts, int iterations)
+{
+    // longer than create_font_runs itemizes
+    std::string long_label;
+    while (long_label.size() <= max_shaped_length)
+        long_label += test::lorem::latin;
+
+    // digits and punctuation alone have no script, harfbuzz takes them from the fallback fonts
+    const std::string labels[] = {
+        "File",
+        "123",
+        "# 1",
+        "100%",
+        "Save As...",
+        "Quit (Ctrl+Q)",
+        "AV To Wa Ty Yo 1,234.56",
+        "office affine fluffy waffle",
+        "width: 100%; height: auto;",
+        "The quick brown fox jumps over the lazy dog!",
+        test::lorem::latin,
+        long_label,
+    };
+
+    fprintf(stdout, "\nsimple shaping against harfbuzz without ligatures (us per string)\n");
+    fprintf(
+        stdout,
+        "%-28s %8s %8s %10s %8s %8s  %s\n",
+        "text",
+        "kerning",
+        "glyphs",
+        "harfbuzz",
+        "simple",
+        "speedup",
+        "output"
+    );
+    bool all_match = true;
+    for (const auto& label : labels)
+    {
+        std::string text = label;
+        for (bool kerning : { true, false })
+        {
+            ShapingOptions full;
+            full.ligatures = false;
+            full.kerning   = kerning;
+            ShapingOptions simple = full;
+            simple.simple         = true;
+
+            const auto out    = std::pmr::get_default_resource();
+            const auto hb_run = create_shapers_in(text, fonts, out, full);
+            const auto run    = create_shapers_in(text, fonts, out, simple);
+            const auto c      = compare(hb_run, run);
+            const bool match  = c.same_glyphs && c.max_pos_delta == 0;
+            all_match         = all_match && match;
+
+            const double hb_us     = shape_us(text, fonts, iterations, full);
+            const double simple_us = shape_us(text, fonts, iterations, simple);
+            fprintf(
+                stdout,
+                "%-28.28s %8s %8d %10.2f %8.2f %7.1fx  %s\n",
+                label.c_str(),
+                kerning ? "on" : "off",
+                run.total_glyphs_n,
+                hb_us,
+                simple_us,
+                hb_us / simple_us,
+                match ? "same" : c.same_glyphs ? "positions differ" : "glyphs differ"
+            );
+        }
+    }
+    fprintf(stdout, "%s\n", all_match ? "simple shaping matches harfbuzz" : "simple shaping differs");
+    return all_match;
+}
+
+struct Allocations
+{
+    uint64_t cpp     = 0; // through operator new
+    uint64_t mallocs = 0;
+    uint64_t frees   = 0;
+};
+
+// heap allocations of shaping the texts over and over once warmed up, the runs go to an arena
+Allocations steady_state_allocations(std::vector<std::string>& texts, Font::Map& fonts, int passes)
+{
+    Arena frame;
+    for (int pass = -1; pass < passes; ++pass)
+    {
+        // the first pass grows the arenas and the harfbuzz buffers
+        if (pass == 0)
+        {
+            heap_allocations_n.store(0);
+            malloc_calls_n.store(0);
+            free_calls_n.store(0);
+        }
+        for (auto& text : texts)
+            create_shapers_in(text, fonts, &frame);
+        frame.reset();
+    }
+    const Allocations counted { heap_allocations_n.load(), malloc_calls_n.load(), free_calls_n.load() };
+
+    const auto scratch_size = ShapingScratch::of_thread().arena.capacity();
+    fprintf(
+        stdout,
+        "arenas: %zu KiB of runs, %zu KiB of scratch\n",
+        frame.capacity() / 1024,
+        scratch_size / 1024
+    );
+    return counted;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    const bool warm_up   = !(argc > 2 && std::string(argv[2]) == "--no-warm-up");
+
+    Library library;
+    if (!library.init())
+    {
+        fprintf(stderr, "library init failed\n");
+        return 1;
+    }
+
+    FontSet ft_fonts, ot_fonts;
+    ft_fonts.init(library, FontFuncs::FreeType, warm_up);
+    ot_fonts.init(library, FontFuncs::OpenType, warm_up);
+
+    using P        = std::pair<const char*, const char*>;
+    auto test_strs = {
+        P { "latin", test::lorem::latin },       P { "arabian", test::lorem::arabian },
+        P { "hebrew", test::lorem::hebrew },     P { "armenian", test::lorem::armenian },
+        P { "chinese", test::lorem::chinese },   P { "japanese", test::lorem::japanese },
+        P { "korean", test::lorem::korean },     P { "greek", test::lorem::greek },
+        P { "russian", test::lorem::russian },   P { "indian", test::lorem::indian },
+        P { "thai", test::lorem::thai },         P { "mixed", test::adhoc::mixed_cstr },
+        P { "emojis", test::adhoc::emojis },
+    };
+
+    fprintf(stdout, "shaping, %d iterations (us per string)\n", iterations);
+    fprintf(stdout, "shape plans %s\n", warm_up ? "warmed up" : "compiled on first use");
+    fprintf(
+        stdout,
+        "%-10s %8s %10s %10s %10s %8s  %s\n",
+        "script",
+        "glyphs",
+        "first",
+        "freetype",
+        "opentype",
+        "speedup",
+        "metrics"
+    );
+    bool all_match = true;
+    for (auto [label, cstr] : test_strs)
+    {
+        std::string text = cstr;
+
+        // the fonts are created up front, this is the shaping and the plans it may compile
+        using Clock        = std::chrono::steady_clock;
+        const auto then    = Clock::now();
+        const auto ot_run  = create_shapers(text, ot_fonts.map);
+        const double first = std::chrono::duration<double, std::micro>(Clock::now() - then).count();
+        const auto ft_run  = create_shapers(text, ft_fonts.map);
+        const auto c      = compare(ft_run, ot_run);
+        // a unit of 26.6 is rounding
+        const bool match = c.same_glyphs && c.max_pos_delta <= 1;
+        all_match        = all_match && match;
+
+        const double ft_us = shape_us(text, ft_fonts.map, iterations);
+        const double ot_us = shape_us(text, ot_fonts.map, iterations);
+        fprintf(
+            stdout,
+            "%-10s %8d %10.1f %10.1f %10.1f %7.2fx  %s (max delta %d/64 px)\n",
+            label,
+            ot_run.total_glyphs_n,
+            first,
+            ft_us,
+            ot_us,
+            ft_us / ot_us,
+            match ? "match" : c.same_glyphs ? "positions differ" : "glyphs differ",
+            c.max_pos_delta
+        );
+    }
+    fprintf(stdout, "%s\n", all_match ? "opentype metrics match freetype" : "opentype metrics differ from freetype");
+
+    std::vector<std::string> corpus;
+    for (auto [label, cstr] : test_strs)
+        corpus.emplace_back(cstr);
+    const int passes           = std::max(1, iterations / 10);
+    const auto allocations = steady_state_allocations(corpus, ot_fonts.map, passes);
+    fprintf(
+        stdout,
+        "steady state: %llu operator new over %d passes of the corpus\n",
+        (unsigned long long) allocations.cpp,
+        passes
+    );
+    if (FONT_FRONT_COUNTS_MALLOC)
+    {
+        const double per_string = (double) allocations.mallocs / ((double) passes * corpus.size());
+        fprintf(
+            stdout,
+            "steady state: %llu malloc and %llu free (%.1f mallocs per string, SheenBidi and harfbuzz)\n",
+            (unsigned long long) allocations.mallocs,
+            (unsigned long long) allocations.frees,
+            per_string
+        );
+    }
+    else
+    {
+        fprintf(stdout, "malloc isn't counted on this platform, only the C++ allocations are\n");
+    }
+
+    const bool simple_match = simple_conforms(ot_fonts.map, iterations);
+
+    ft_fonts.destroy();
+    ot_fonts.destroy();
+    library.destroy();
+    return all_match && allocations.cpp == 0 && simple_match ? 0 : 2;
+}
@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace typesetting
+{
+/**
+ * Epoch based reclamation. A reader announces the epoch it reads in for the duration of a
+ * ReadGuard, writers retire what they unlinked in the current epoch and advance it. Retired
+ * memory is freed once every reader announced a later epoch or left, so readers never lock and
+ * never find freed memory.
+ */
+namespace epoch
+{
+constexpr size_t max_threads = 256;
+
+struct Domain
+{
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch { 0 }; // 0 while not reading
+        std::atomic<bool> taken { false };
+    };
+
+    struct Retired
+    {
+        uint64_t epoch;
+        void* ptr;
+        void (*deleter)(void*);
+    };
+
+    static Domain& instance()
+    {
+        static Domain domain;
+        return domain;
+    }
+
+    ~Domain()
+    {
+        for (auto& r : retired)
+            r.deleter(r.ptr);
+    }
+
+    // the slot of the calling thread, given back when the thread exits
+    Slot& thread_slot()
+    {
+        struct Lease
+        {
+            explicit Lease(Domain& d)
+            {
+                for (size_t i = 0; i < max_threads; ++i)
+                {
+                    bool expected = false;
+                    if (d.slots[i].taken.compare_exchange_strong(expected, true))
+                    {
+                        slot    = &d.slots[i];
+                        auto hw = d.slots_n.load();
+                        while (hw < i + 1 && !d.slots_n.compare_exchange_weak(hw, i + 1))
+                            ;
+                        return;
+                    }
+                }
+                fprintf(stderr, "epoch: more than %zu reader threads\n", max_threads);
+                abort();
+            }
+
+            ~Lease()
+            {
+                slot->epoch.store(0, std::memory_order_release);
+                slot->taken.store(false, std::memory_order_release);
+            }
+
+            Slot* slot = nullptr;
+        };
+
+        thread_local Lease lease(*this);
+        return *lease.slot;
+    }
+
+    void retire(void* ptr, void (*deleter)(void*))
+    {
+        const auto retired_in = global.fetch_add(1, std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> lock(mutex);
+        retired.push_back({ retired_in, ptr, deleter });
+    }
+
+    // frees what no reader can reach anymore
+    void reclaim()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t oldest_reader = UINT64_MAX;
+        for (size_t i = 0, n = slots_n.load(std::memory_order_acquire); i < n; ++i)
+            if (auto e = slots[i].epoch.load(std::memory_order_acquire))
+                oldest_reader = std::min(oldest_reader, e);
+
+        std::vector<Retired> freed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto reachable = std::partition(
+                retired.begin(),
+                retired.end(),
+                [oldest_reader](const Retired& r) { return r.epoch >= oldest_reader; }
+            );
+            freed.assign(reachable, retired.end());
+            retired.erase(reachable, retired.end());
+        }
+        for (auto& r : freed)
+            r.deleter(r.ptr);
+    }
+
+    std::atomic<uint64_t> global { 1 };
+    Slot slots[max_threads];
+    std::atomic<size_t> slots_n { 0 }; // high water mark of the taken slots
+
+    std::mutex mutex;
+    std::vector<Retired> retired;
+};
+
+inline int& guard_depth()
+{
+    thread_local int depth = 0;
+    return depth;
+}
+
+// Keeps what the thread reads alive, nests
+struct ReadGuard
+{
+    ReadGuard()
+        : slot(Domain::instance().thread_slot())
+    {
+        if (guard_depth()++ == 0)
+        {
+            // acquiring the epoch makes what was unlinked before it was advanced visible
+            slot.epoch.store(Domain::instance().global.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // the announcement is visible before anything is read
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    ~ReadGuard()
+    {
+        if (--guard_depth() == 0)
+            slot.epoch.store(0, std::memory_order_release);
+    }
+
+    ReadGuard(const ReadGuard&)            = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+    Domain::Slot& slot;
+};
+
+template <typename T>
+void retire(T* ptr)
+{
+    Domain::instance().retire(ptr, [](void* p) { delete (T*) p; });
+}
+} // namespace epoch
+
+/**
+ * Hash map for caches read from many threads and rarely written. Keys are spread over shards,
+ * each an open addressing table published through an atomic pointer, so a hit reads the table
+ * without locking or writing any shared memory. Writers take the lock of the shard: inserts fill
+ * an empty slot in place, erasing leaves a tombstone in the slot, and growing, or dropping the
+ * tombstones once they take half of the used slots, publishes a rebuilt table and retires the old
+ * one.
+ *
+ * get_or_create creates a value once per key: the first thread missing a key inserts a pending
+ * entry and creates the value without holding the lock, threads missing the same key meanwhile
+ * wait for it, and the other keys of the shard stay available. A create function must not ask
+ * for its own key.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>, size_t shards_n = 64>
+struct ConcurrentCache
+{
+    static_assert((shards_n & (shards_n - 1)) == 0, "shards_n must be a power of two");
+
+    ConcurrentCache()
+    {
+        for (auto& shard : shards)
+            shard.table.store(new Table(min_capacity), std::memory_order_relaxed);
+    }
+
+    ~ConcurrentCache()
+    {
+        for (auto& shard : shards)
+        {
+            auto* table = shard.table.load(std::memory_order_relaxed);
+            for (size_t i = 0; i <= table->mask; ++i)
+                if (auto* entry = table->slots[i].load(std::memory_order_relaxed); entry != tombstone())
+                    delete entry;
+            delete table;
+        }
+    }
+
+    ConcurrentCache(const ConcurrentCache&)            = delete;
+    ConcurrentCache& operator=(const ConcurrentCache&) = delete;
+
+    // A copy of the value, marked used in the given frame
+    std::optional<Value> find(const Key& key, uint64_t used = 0)
+    {
+        const auto h = mix(key);
+        epoch::ReadGuard guard;
+        auto* entry = lookup(shards[shard_of(h)].table.load(std::memory_order_acquire), key, h);
+        if (!entry || entry->state.load(std::memory_order_acquire) != Ready)
+            return std::nullopt;
+        touch(*entry, used);
+        return entry->value;
+    }
+
+    // Marks the value used in the given frame without copying it, false if there's none
+    bool mark_used(const Key& key, uint64_t used)
+    {
+        const auto h = mix(key);
+        epoch::ReadGuard guard;
+        auto* entry = lookup(shards[shard_of(h)].table.load(std::memory_order_acquire), key, h);
+        if (!entry || entry->state.load(std::memory_order_acquire) != Ready)
+            return false;
+        touch(*entry, used);
+        return true;
+    }
+
+    // A copy of the value and the frame it was last used in, without marking it used
+    std::optional<std::pair<Value, uint64_t>> peek(const Key& key)
+    {
+        const auto h = mix(key);
+        epoch::ReadGuard guard;
+        auto* entry = lookup(shards[shard_of(h)].table.load(std::memory_order_acquire), key, h);
+        if (!entry || entry->state.load(std::memory_order_acquire) != Ready)
+            return std::nullopt;
+        return std::make_pair(entry->value, entry->last_used.load(std::memory_order_relaxed));
+    }
+
+    template <typename Create>
+    Value get_or_create(const Key& key, Create&& create, uint64_t used = 0)
+    {
+        const auto h = mix(key);
+        auto& shard  = shards[shard_of(h)];
+        // keeps a pending entry alive while waiting for it
+        epoch::ReadGuard guard;
+        for (;;)
+        {
+            auto* entry = lookup(shard.table.load(std::memory_order_acquire), key, h);
+            if (entry && entry->state.load(std::memory_order_acquire) == Ready)
+            {
+                touch(*entry, used);
+                return entry->value;
+            }
+
+            bool creating = false;
+            {
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                entry = lookup(shard.table.load(std::memory_order_relaxed), key, h);
+                if (!entry)
+                {
+                    entry    = new Entry { key };
+                    creating = true;
+                    insert_locked(shard, entry);
+                }
+                else
+                {
+                    shard.created.wait(lock, [entry] { return entry->state.load(std::memory_order_acquire) != Pending; });
+                }
+            }
+
+            if (!creating)
+            {
+                // a failed creation is retried
+                if (entry->state.load(std::memory_order_acquire) == Ready)
+                {
+                    touch(*entry, used);
+                    return entry->value;
+                }
+                continue;
+            }
+
+            try
+            {
+                entry->value = create();
+            }
+            catch (...)
+            {
+                finish(shard, entry, Failed);
+                throw;
+            }
+            entry->last_used.store(used, std::memory_order_relaxed);
+            finish(shard, entry, Ready);
+            return entry->value;
+        }
+    }
+
+    // Sets the value of the key, replacing the one it had
+    void insert_or_assign(const Key& key, const Value& value, uint64_t used = 0)
+    {
+        const auto h = mix(key);
+        auto& shard  = shards[shard_of(h)];
+
+        auto* entry = new Entry { key, value };
+        entry->last_used.store(used, std::memory_order_relaxed);
+        entry->state.store(Ready, std::memory_order_relaxed);
+        {
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            auto* table = shard.table.load(std::memory_order_relaxed);
+            auto* slot  = find_slot(table, key, h);
+            if (slot)
+            {
+                auto* replaced = slot->load(std::memory_order_relaxed);
+                shard.created.wait(lock, [replaced] { return replaced->state.load(std::memory_order_acquire) != Pending; });
+                // the wait let others in, the slot may have moved
+                table = shard.table.load(std::memory_order_relaxed);
+                slot  = find_slot(table, key, h);
+            }
+            if (slot)
+            {
+                auto* replaced = slot->load(std::memory_order_relaxed);
+                slot->store(entry, std::memory_order_release);
+                epoch::retire(replaced);
+            }
+            else
+            {
+                insert_locked(shard, entry);
+            }
+        }
+        epoch::Domain::instance().reclaim();
+    }
+
+    bool erase(const Key& key)
+    {
+        const auto h = mix(key);
+        auto& shard  = shards[shard_of(h)];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto* table = shard.table.load(std::memory_order_relaxed);
+            auto* slot  = find_slot(table, key, h);
+            auto* entry = slot ? slot->load(std::memory_order_relaxed) : nullptr;
+            if (!entry || entry->state.load(std::memory_order_acquire) != Ready)
+                return false;
+            bury_locked(shard, *slot);
+            compact_locked(shard);
+        }
+        epoch::Domain::instance().reclaim();
+        return true;
+    }
+
+    // Erases the created entries the predicate (key, value, last used) is true for
+    template <typename Pred>
+    size_t erase_if(Pred&& pred)
+    {
+        size_t erased = 0;
+        for (auto& shard : shards)
+            erased += erase_from(shard, pred);
+        return erased;
+    }
+
+    void clear()
+    {
+        erase_if([](const Key&, const Value&, uint64_t) { return true; });
+    }
+
+    // Calls the function with the key, value and last used of each created entry
+    template <typename F>
+    void for_each(F&& f) const
+    {
+        epoch::ReadGuard guard;
+        for (auto& shard : shards)
+        {
+            const auto* table = shard.table.load(std::memory_order_acquire);
+            for (size_t i = 0; i <= table->mask; ++i)
+            {
+                const auto* entry = table->slots[i].load(std::memory_order_acquire);
+                if (is_live(entry) && entry->state.load(std::memory_order_acquire) == Ready)
+                    f(entry->key, entry->value, entry->last_used.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+private:
+    enum State : int
+    {
+        Pending,
+        Ready,
+        Failed
+    };
+
+    struct Entry
+    {
+        Key key;
+        Value value {};
+        std::atomic<uint64_t> last_used { 0 };
+        std::atomic<int> state { Pending };
+    };
+
+    struct Table
+    {
+        explicit Table(size_t capacity)
+            : mask(capacity - 1)
+            , slots(new std::atomic<Entry*>[capacity])
+        {
+            for (size_t i = 0; i < capacity; ++i)
+                slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<Entry*>[]> slots;
+        size_t used       = 0; // by entries and tombstones, written under the shard lock
+        size_t tombstones = 0;
+    };
+
+    struct alignas(64) Shard
+    {
+        std::atomic<Table*> table { nullptr };
+        std::mutex mutex;
+        std::condition_variable created;
+    };
+
+    static constexpr size_t min_capacity = 16;
+
+    static uint64_t mix(const Key& key)
+    {
+        uint64_t h = (uint64_t) Hash {}(key) * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 29);
+    }
+
+    // slots take the low bits of the hash, shards the high ones
+    static size_t shard_of(uint64_t h) { return (size_t) (h >> 48) & (shards_n - 1); }
+
+    // left in the slot of an erased entry, probing goes on past it
+    static Entry* tombstone()
+    {
+        alignas(Entry) static unsigned char marker;
+        return reinterpret_cast<Entry*>(&marker);
+    }
+
+    static bool is_live(const Entry* entry) { return entry && entry != tombstone(); }
+
+    static std::atomic<Entry*>* find_slot(Table* table, const Key& key, uint64_t h)
+    {
+        for (size_t i = h & table->mask;; i = (i + 1) & table->mask)
+        {
+            auto* entry = table->slots[i].load(std::memory_order_acquire);
+            if (!entry)
+                return nullptr;
+            if (entry != tombstone() && entry->key == key)
+                return &table->slots[i];
+        }
+    }
+
+    static Entry* lookup(Table* table, const Key& key, uint64_t h)
+    {
+        auto* slot = find_slot(table, key, h);
+        return slot ? slot->load(std::memory_order_acquire) : nullptr;
+    }
+
+    // only increases, readers hitting in the same frame don't write the entry's cache line
+    static void touch(Entry& entry, uint64_t used)
+    {
+        if (entry.last_used.load(std::memory_order_relaxed) < used)
+            entry.last_used.store(used, std::memory_order_relaxed);
+    }
+
+    // the key isn't in the table, its entry takes the first empty slot or tombstone
+    static void place(Table* table, Entry* entry)
+    {
+        size_t i = mix(entry->key) & table->mask;
+        for (;; i = (i + 1) & table->mask)
+        {
+            auto* taken = table->slots[i].load(std::memory_order_relaxed);
+            if (!taken)
+            {
+                table->used++;
+                break;
+            }
+            if (taken == tombstone())
+            {
+                table->tombstones--;
+                break;
+            }
+        }
+        table->slots[i].store(entry, std::memory_order_release);
+    }
+
+    // Publishes a table with the entries of the current one the predicate keeps, retiring it
+    template <typename Keep>
+    void rebuild_locked(Shard& shard, size_t entries_n, Keep&& keep)
+    {
+        auto* old_table = shard.table.load(std::memory_order_relaxed);
+        size_t capacity = min_capacity;
+        while (capacity < entries_n * 2)
+            capacity *= 2;
+
+        auto* table = new Table(capacity);
+        for (size_t i = 0; i <= old_table->mask; ++i)
+            if (auto* entry = old_table->slots[i].load(std::memory_order_relaxed); is_live(entry) && keep(entry))
+                place(table, entry);
+        shard.table.store(table, std::memory_order_release);
+        epoch::retire(old_table);
+    }
+
+    void insert_locked(Shard& shard, Entry* entry)
+    {
+        auto* table = shard.table.load(std::memory_order_relaxed);
+        // at most 3/4 full counting the tombstones, so probing always ends at an empty slot
+        if ((table->used + 1) * 4 > (table->mask + 1) * 3)
+        {
+            rebuild_locked(shard, table->used - table->tombstones + 1, [](Entry*) { return true; });
+            table = shard.table.load(std::memory_order_relaxed);
+        }
+        place(table, entry);
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Replaces the entry in the slot with a tombstone and retires it
+    void bury_locked(Shard& shard, std::atomic<Entry*>& slot)
+    {
+        auto* entry = slot.load(std::memory_order_relaxed);
+        slot.store(tombstone(), std::memory_order_release);
+        shard.table.load(std::memory_order_relaxed)->tombstones++;
+        count.fetch_sub(1, std::memory_order_relaxed);
+        epoch::retire(entry);
+    }
+
+    // Drops the tombstones once they're half of the used slots, which keeps erasing O(1) amortized
+    void compact_locked(Shard& shard)
+    {
+        auto* table = shard.table.load(std::memory_order_relaxed);
+        if (table->tombstones * 2 > table->used)
+            rebuild_locked(shard, table->used - table->tombstones, [](Entry*) { return true; });
+    }
+
+    void finish(Shard& shard, Entry* entry, State state)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            entry->state.store(state, std::memory_order_release);
+            if (state == Failed)
+            {
+                auto* table = shard.table.load(std::memory_order_relaxed);
+                bury_locked(shard, *find_slot(table, entry->key, mix(entry->key)));
+                compact_locked(shard);
+            }
+        }
+        shard.created.notify_all();
+    }
+
+    template <typename Pred>
+    size_t erase_from(Shard& shard, Pred&& pred)
+    {
+        size_t erased = 0;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto* table = shard.table.load(std::memory_order_relaxed);
+            for (size_t i = 0; i <= table->mask; ++i)
+            {
+                auto* entry = table->slots[i].load(std::memory_order_relaxed);
+                if (is_live(entry) && entry->state.load(std::memory_order_acquire) == Ready
+                    && pred(entry->key, entry->value, entry->last_used.load(std::memory_order_relaxed)))
+                {
+                    bury_locked(shard, table->slots[i]);
+                    erased++;
+                }
+            }
+            if (erased == 0)
+                return 0;
+            compact_locked(shard);
+        }
+        epoch::Domain::instance().reclaim();
+        return erased;
+    }
+
+    Shard shards[shards_n];
+    std::atomic<size_t> count { 0 };
+};
+} // namespace typesetting
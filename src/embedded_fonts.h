@@ -0,0 +1,51 @@
+#pragma once
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_GZIP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * Fonts compiled into the binary gzip compressed, by cmake/embed_fonts.cmake into a generated
+ * source of their own. A font is decompressed when it's first created, until then only its
+ * compressed bytes are in the binary and they aren't touched.
+ */
+namespace embedded_fonts
+{
+struct Entry
+{
+    const char* name; // file name of the font
+    const unsigned char* data;
+    uint32_t compressed_size;
+    uint32_t size;
+};
+
+// in the generated source
+extern const Entry entries[];
+extern const size_t entries_n;
+
+inline const Entry* find(const char* name)
+{
+    for (size_t i = 0; i < entries_n; ++i)
+        if (strcmp(entries[i].name, name) == 0)
+            return &entries[i];
+    return nullptr;
+}
+
+// Decompresses the font into the buffer, with the memory of the FreeType library for inflating
+inline bool decompress(const Entry& entry, FT_Memory memory, std::vector<unsigned char>& font)
+{
+    font.resize(entry.size);
+    FT_ULong size = entry.size;
+    if (FT_Gzip_Uncompress(memory, font.data(), &size, entry.data, entry.compressed_size) || size != entry.size)
+    {
+        font.clear();
+        return false;
+    }
+    return true;
+}
+} // namespace embedded_fonts
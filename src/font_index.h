@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+/**
+ * Font coverage index written by font_indexer. Like the atlas snapshot the sections are plain
+ * arrays laid back to back and used straight from a memory mapping:
+ *
+ *   Header | fonts | coverage | best ranges | scripts | names
+ *
+ * Coverage holds the codepoint ranges of each font. Best ranges partition all the covered
+ * codepoints by the font picked for them, so "which font for this codepoint" is one binary search
+ * and no font is opened to answer it. Scripts are the scripts each font supports, sorted by
+ * script and then by how many of its codepoints the font has, so the best font of a script is the
+ * first entry of the script. Names are the zero terminated file names of the fonts, relative to
+ * the indexed directory. Only the first face of a collection is indexed.
+ */
+namespace typesetting
+{
+namespace font_index
+{
+constexpr uint32_t magic   = 0x49464646; // "FFFI"
+constexpr uint32_t version = 1;
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fonts_n;
+    uint32_t coverage_n;
+    uint32_t best_n;
+    uint32_t scripts_n;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+struct FontEntry
+{
+    uint32_t name_offset; // into the names
+    uint32_t coverage_start;
+    uint32_t coverage_n;
+    uint32_t codepoints_n;
+};
+
+struct Range
+{
+    uint32_t first;
+    uint32_t last; // inclusive
+};
+
+struct BestRange
+{
+    uint32_t first;
+    uint32_t last;
+    uint32_t font;
+};
+
+struct ScriptEntry
+{
+    uint32_t script; // hb_script_t
+    uint32_t font;
+    uint32_t codepoints_n; // of the script in the font
+};
+
+// Gathered index to be written to a file
+struct Contents
+{
+    std::vector<FontEntry> fonts;
+    std::vector<Range> coverage;
+    std::vector<BestRange> best;
+    std::vector<ScriptEntry> scripts;
+    std::vector<char> names;
+};
+
+inline size_t file_size(const Header& h)
+{
+    return sizeof(Header) + h.fonts_n * sizeof(FontEntry) + h.coverage_n * sizeof(Range)
+         + h.best_n * sizeof(BestRange) + h.scripts_n * sizeof(ScriptEntry) + h.names_size;
+}
+
+inline bool write(const char* path, const Contents& contents)
+{
+    Header header;
+    header.magic      = magic;
+    header.version    = version;
+    header.fonts_n    = (uint32_t) contents.fonts.size();
+    header.coverage_n = (uint32_t) contents.coverage.size();
+    header.best_n     = (uint32_t) contents.best.size();
+    header.scripts_n  = (uint32_t) contents.scripts.size();
+    header.names_size = (uint32_t) contents.names.size();
+    header.reserved   = 0;
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    auto write_array = [&](const void* ptr, size_t size)
+    { return size == 0 || fwrite(ptr, size, 1, file) == 1; };
+
+    bool ok = write_array(&header, sizeof(header))
+           && write_array(contents.fonts.data(), contents.fonts.size() * sizeof(FontEntry))
+           && write_array(contents.coverage.data(), contents.coverage.size() * sizeof(Range))
+           && write_array(contents.best.data(), contents.best.size() * sizeof(BestRange))
+           && write_array(contents.scripts.data(), contents.scripts.size() * sizeof(ScriptEntry))
+           && write_array(contents.names.data(), contents.names.size());
+
+    fclose(file);
+    return ok;
+}
+
+// Sections of a mapped index
+struct View
+{
+    const Header* header       = nullptr;
+    const FontEntry* fonts     = nullptr;
+    const Range* coverage      = nullptr;
+    const BestRange* best      = nullptr;
+    const ScriptEntry* scripts = nullptr;
+    const char* names          = nullptr;
+};
+
+inline bool parse(const uint8_t* data, size_t size, View& view)
+{
+    if (!data || size < sizeof(Header))
+        return false;
+
+    const auto* header = (const Header*) data;
+    if (header->magic != magic || header->version != version || size < file_size(*header))
+        return false;
+
+    view.header   = header;
+    view.fonts    = (const FontEntry*) (header + 1);
+    view.coverage = (const Range*) (view.fonts + header->fonts_n);
+    view.best     = (const BestRange*) (view.coverage + header->coverage_n);
+    view.scripts  = (const ScriptEntry*) (view.best + header->best_n);
+    view.names    = (const char*) (view.scripts + header->scripts_n);
+
+    if (header->names_size == 0 || view.names[header->names_size - 1] != 0)
+        return false;
+
+    for (uint32_t i = 0; i < header->fonts_n; ++i)
+    {
+        const auto& font = view.fonts[i];
+        if (font.name_offset >= header->names_size || font.coverage_start + font.coverage_n > header->coverage_n)
+            return false;
+    }
+    for (uint32_t i = 0; i < header->best_n; ++i)
+        if (view.best[i].font >= header->fonts_n)
+            return false;
+    for (uint32_t i = 0; i < header->scripts_n; ++i)
+        if (view.scripts[i].font >= header->fonts_n)
+            return false;
+
+    return true;
+}
+
+// A mapped index answering which font to use without opening any
+struct Index
+{
+    bool init(const char* path)
+    {
+        if (!file.init(path))
+            return false;
+        if (!parse(file.data, file.size, view))
+        {
+            file.destroy();
+            return false;
+        }
+        return true;
+    }
+
+    void destroy()
+    {
+        file.destroy();
+        view = {};
+    }
+
+    bool is_loaded() const { return view.header != nullptr; }
+
+    uint32_t fonts_n() const { return view.header ? view.header->fonts_n : 0; }
+
+    const char* font_name(uint32_t font) const { return view.names + view.fonts[font].name_offset; }
+
+    // the font picked for the codepoint, -1 if none has it
+    int font_for_codepoint(uint32_t codepoint) const
+    {
+        if (!view.header)
+            return -1;
+        const auto* end = view.best + view.header->best_n;
+        const auto* it  = std::upper_bound(
+            view.best,
+            end,
+            codepoint,
+            [](uint32_t cp, const BestRange& range) { return cp < range.first; }
+        );
+        if (it == view.best || (--it)->last < codepoint)
+            return -1;
+        return (int) it->font;
+    }
+
+    // the font with the most codepoints of the script, -1 if none supports it
+    int font_for_script(uint32_t script) const
+    {
+        if (!view.header)
+            return -1;
+        const auto* end = view.scripts + view.header->scripts_n;
+        const auto* it  = std::lower_bound(
+            view.scripts,
+            end,
+            script,
+            [](const ScriptEntry& entry, uint32_t s) { return entry.script < s; }
+        );
+        return it != end && it->script == script ? (int) it->font : -1;
+    }
+
+    bool covers(uint32_t font, uint32_t codepoint) const
+    {
+        const auto* first = view.coverage + view.fonts[font].coverage_start;
+        const auto* last  = first + view.fonts[font].coverage_n;
+        const auto* it    = std::upper_bound(
+            first,
+            last,
+            codepoint,
+            [](uint32_t cp, const Range& range) { return cp < range.first; }
+        );
+        return it != first && (it - 1)->last >= codepoint;
+    }
+
+    utlz::MappedFile file;
+    View view;
+};
+} // namespace font_index
+} // namespace typesetting
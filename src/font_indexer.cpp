@@ -0,0 +1,280 @@
+/**
+ * Offline font indexer. Scans a font directory for the Unicode coverage and the scripts of each
+ * font and writes a font index (see font_index.h) that IndexedFonts looks the fallback fonts up
+ * in, so that a large font set is neither opened nor probed at runtime.
+ *
+ *   font_indexer <font directory> <output file> [options]
+ *
+ *   --min-script-codepoints <n> codepoints of a script a font needs to support it (default 16)
+ *
+ * Each covered codepoint goes to the font with the most codepoints of its script. Codepoints of
+ * no particular script (punctuation, symbols, emojis) go to the font with the most codepoints of
+ * the surrounding 256, which tells an emoji or a math font from a text font having a few of them.
+ * Ties go to the first font by file name.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <hb.h>
+
+#include "font_index.h"
+
+namespace
+{
+namespace fs = std::filesystem;
+
+constexpr uint32_t max_codepoint = 0x10ffff;
+constexpr uint32_t page_shift    = 8;
+
+struct Options
+{
+    std::string font_dir;
+    std::string output_file;
+    uint32_t min_script_codepoints = 16;
+};
+
+struct ScannedFont
+{
+    std::string name;
+    std::vector<bool> has; // by codepoint
+    std::vector<typesetting::font_index::Range> coverage;
+    std::unordered_map<hb_script_t, uint32_t> script_codepoints;
+    std::unordered_map<uint32_t, uint32_t> page_codepoints;
+    uint32_t codepoints_n = 0;
+};
+
+bool parse_options(int argc, char** argv, Options& options)
+{
+    if (argc < 3)
+        return false;
+
+    options.font_dir    = argv[1];
+    options.output_file = argv[2];
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value  = i + 1 < argc;
+        if (arg == "--min-script-codepoints" && has_value)
+            options.min_script_codepoints = (uint32_t) strtoul(argv[++i], nullptr, 0);
+        else
+            return false;
+    }
+
+    return true;
+}
+
+bool is_font_file(const fs::path& path)
+{
+    auto ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char) tolower(c); });
+    return ext == ".ttf" || ext == ".otf" || ext == ".ttc" || ext == ".otc";
+}
+
+bool is_generic_script(hb_script_t script)
+{
+    return script == HB_SCRIPT_COMMON || script == HB_SCRIPT_INHERITED || script == HB_SCRIPT_UNKNOWN;
+}
+
+// codepoints of the unicode charmap of the first face
+bool scan_font(FT_Library library, const fs::path& path, ScannedFont& font)
+{
+    FT_Face face;
+    if (FT_New_Face(library, path.string().c_str(), 0, &face))
+        return false;
+    if (FT_Select_Charmap(face, FT_ENCODING_UNICODE))
+    {
+        FT_Done_Face(face);
+        return false;
+    }
+
+    auto* unicode_funcs = hb_unicode_funcs_get_default();
+    font.name           = path.filename().string();
+    font.has.assign(max_codepoint + 1, false);
+
+    FT_UInt glyph_index;
+    for (FT_ULong c = FT_Get_First_Char(face, &glyph_index); glyph_index != 0;
+         c          = FT_Get_Next_Char(face, c, &glyph_index))
+    {
+        if (c > max_codepoint)
+            break;
+        const auto cp = (uint32_t) c;
+        font.has[cp]  = true;
+        ++font.codepoints_n;
+        ++font.page_codepoints[cp >> page_shift];
+
+        const auto script = hb_unicode_script(unicode_funcs, cp);
+        if (!is_generic_script(script))
+            ++font.script_codepoints[script];
+
+        if (!font.coverage.empty() && font.coverage.back().last + 1 == cp)
+            font.coverage.back().last = cp;
+        else
+            font.coverage.push_back({ cp, cp });
+    }
+
+    FT_Done_Face(face);
+    return font.codepoints_n > 0;
+}
+
+typesetting::font_index::Contents build_index(const std::vector<ScannedFont>& fonts, const Options& options)
+{
+    using namespace typesetting::font_index;
+    Contents contents;
+
+    for (const auto& font : fonts)
+    {
+        FontEntry entry;
+        entry.name_offset    = (uint32_t) contents.names.size();
+        entry.coverage_start = (uint32_t) contents.coverage.size();
+        entry.coverage_n     = (uint32_t) font.coverage.size();
+        entry.codepoints_n   = font.codepoints_n;
+        contents.fonts.push_back(entry);
+        contents.coverage.insert(contents.coverage.end(), font.coverage.begin(), font.coverage.end());
+        contents.names.insert(contents.names.end(), font.name.begin(), font.name.end());
+        contents.names.push_back(0);
+    }
+
+    for (uint32_t i = 0; i < fonts.size(); ++i)
+        for (auto [script, codepoints_n] : fonts[i].script_codepoints)
+            if (codepoints_n >= options.min_script_codepoints)
+                contents.scripts.push_back({ (uint32_t) script, i, codepoints_n });
+    std::sort(
+        contents.scripts.begin(),
+        contents.scripts.end(),
+        [](const ScriptEntry& lhs, const ScriptEntry& rhs)
+        {
+            if (lhs.script != rhs.script)
+                return lhs.script < rhs.script;
+            if (lhs.codepoints_n != rhs.codepoints_n)
+                return lhs.codepoints_n > rhs.codepoints_n;
+            return lhs.font < rhs.font;
+        }
+    );
+
+    auto* unicode_funcs = hb_unicode_funcs_get_default();
+    auto count_of       = [](const auto& counts, auto key) -> uint32_t
+    {
+        auto it = counts.find(key);
+        return it != counts.end() ? it->second : 0;
+    };
+
+    for (uint32_t cp = 0; cp <= max_codepoint; ++cp)
+    {
+        const auto script  = hb_unicode_script(unicode_funcs, cp);
+        const bool generic = is_generic_script(script);
+
+        int best = -1;
+        uint64_t best_score = 0;
+        for (uint32_t i = 0; i < fonts.size(); ++i)
+        {
+            if (!fonts[i].has[cp])
+                continue;
+            const uint64_t page  = count_of(fonts[i].page_codepoints, cp >> page_shift);
+            const uint64_t score = generic ? page : (uint64_t) count_of(fonts[i].script_codepoints, script) << 32 | page;
+            if (best < 0 || score > best_score)
+            {
+                best       = (int) i;
+                best_score = score;
+            }
+        }
+        if (best < 0)
+            continue;
+
+        auto& ranges = contents.best;
+        if (!ranges.empty() && ranges.back().last + 1 == cp && ranges.back().font == (uint32_t) best)
+            ranges.back().last = cp;
+        else
+            ranges.push_back({ cp, cp, (uint32_t) best });
+    }
+
+    return contents;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        fprintf(stderr, "usage: font_indexer <font directory> <output file> [--min-script-codepoints <n>]\n");
+        return 1;
+    }
+
+    using Clock     = std::chrono::steady_clock;
+    const auto then = Clock::now();
+
+    std::error_code error;
+    std::vector<fs::path> paths;
+    for (const auto& entry : fs::directory_iterator(options.font_dir, error))
+        if (entry.is_regular_file() && is_font_file(entry.path()))
+            paths.push_back(entry.path());
+    if (error)
+    {
+        fprintf(stderr, "can't read font directory: %s\n", options.font_dir.c_str());
+        return 1;
+    }
+    // the order breaks ties, keep it independent of the file system
+    std::sort(paths.begin(), paths.end());
+
+    FT_Library library;
+    if (FT_Init_FreeType(&library))
+        return 1;
+
+    std::vector<ScannedFont> fonts;
+    for (const auto& path : paths)
+    {
+        ScannedFont font;
+        if (!scan_font(library, path, font))
+        {
+            fprintf(stderr, "skipping %s: no unicode charmap\n", path.string().c_str());
+            continue;
+        }
+        fonts.push_back(std::move(font));
+    }
+    FT_Done_FreeType(library);
+
+    const auto contents = build_index(fonts, options);
+    if (!typesetting::font_index::write(options.output_file.c_str(), contents))
+    {
+        fprintf(stderr, "writing %s failed\n", options.output_file.c_str());
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < fonts.size(); ++i)
+    {
+        fprintf(stdout, "%-48s %7u codepoints", fonts[i].name.c_str(), fonts[i].codepoints_n);
+        for (const auto& entry : contents.scripts)
+        {
+            if (entry.font != i)
+                continue;
+            char tag[5];
+            hb_tag_to_string((hb_tag_t) entry.script, tag);
+            tag[4] = 0;
+            fprintf(stdout, " %s", tag);
+        }
+        fprintf(stdout, "\n");
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - then);
+    fprintf(
+        stdout,
+        "indexed %zu fonts of %s into %s (%zu ranges, %zu scripts) in %lld ms\n",
+        fonts.size(),
+        options.font_dir.c_str(),
+        options.output_file.c_str(),
+        contents.best.size(),
+        contents.scripts.size(),
+        (long long) elapsed.count()
+    );
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace typesetting
+{
+/**
+ * Allocator behind the FT_Memory of the library. FreeType doesn't say what an allocation is for,
+ * so the callers tag their FreeType calls with a MemoryScope and each block is accounted to the
+ * subsystem of the scope it was allocated in.
+ *
+ * Blocks up to max_pooled_size come from free lists of size classes, in shards picked by thread
+ * so that threads rasterizing at the same time rarely share a lock. Larger blocks go to the heap.
+ * Pooled memory is kept until the allocator is destroyed.
+ */
+namespace ft_memory
+{
+enum class Subsystem : uint8_t
+{
+    Library,    // modules, caches and anything untagged
+    Faces,      // opening faces and their tables
+    Sizes,      // size objects and their metrics
+    Rasterizer, // glyph loading and the SDF rasterizer
+    Shaping,    // glyph metrics harfbuzz asks for
+    count
+};
+
+constexpr const char* subsystem_names[] = { "library", "faces", "sizes", "rasterizer", "shaping" };
+
+// the subsystem the calling thread allocates for
+inline Subsystem& current_subsystem()
+{
+    thread_local Subsystem subsystem = Subsystem::Library;
+    return subsystem;
+}
+
+// Tags the FreeType allocations made in its scope
+struct MemoryScope
+{
+    explicit MemoryScope(Subsystem subsystem)
+        : previous(current_subsystem())
+    {
+        current_subsystem() = subsystem;
+    }
+
+    ~MemoryScope() { current_subsystem() = previous; }
+
+    Subsystem previous;
+};
+
+struct Counters
+{
+    std::atomic<int64_t> bytes_live { 0 };
+    std::atomic<int64_t> bytes_peak { 0 };
+    std::atomic<int64_t> blocks_live { 0 };
+    std::atomic<uint64_t> allocations { 0 };
+    std::atomic<uint64_t> pooled { 0 };
+};
+
+constexpr size_t size_classes_n   = 5; // 16, 32, 64, 128 and 256 bytes
+constexpr size_t max_pooled_size  = 256;
+constexpr size_t shards_n         = 8;
+constexpr size_t blocks_per_chunk = 64;
+
+// in front of every block, keeps the blocks 16 bytes aligned
+struct alignas(16) Header
+{
+    uint32_t size;
+    uint8_t subsystem;
+    uint8_t size_class; // size_classes_n when on the heap
+    uint8_t shard;
+};
+
+inline size_t size_class_of(size_t size)
+{
+    size_t index = 0;
+    while ((size_t(16) << index) < size)
+        ++index;
+    return index;
+}
+
+inline size_t class_size(size_t index) { return (size_t(16) << index) + sizeof(Header); }
+
+struct Shard
+{
+    std::mutex mutex;
+    void* free_lists[size_classes_n] {};
+    std::vector<void*> chunks;
+};
+
+struct Allocator
+{
+    bool init()
+    {
+        memory.user    = this;
+        memory.alloc   = &alloc_cb;
+        memory.free    = &free_cb;
+        memory.realloc = &realloc_cb;
+        return true;
+    }
+
+    void destroy()
+    {
+        for (auto& shard : shards)
+        {
+            for (auto* chunk : shard.chunks)
+                free(chunk);
+            shard.chunks.clear();
+            std::fill(std::begin(shard.free_lists), std::end(shard.free_lists), nullptr);
+        }
+    }
+
+    void* allocate(size_t size)
+    {
+        const auto subsystem = current_subsystem();
+        Header* header       = nullptr;
+        if (size <= max_pooled_size)
+        {
+            const auto shard_idx = thread_shard();
+            const auto index     = size_class_of(size);
+            header               = pop(shards[shard_idx], index);
+            if (!header)
+                return nullptr;
+            header->size_class = (uint8_t) index;
+            header->shard      = (uint8_t) shard_idx;
+            counters[(size_t) subsystem].pooled.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            header = (Header*) malloc(sizeof(Header) + size);
+            if (!header)
+                return nullptr;
+            header->size_class = (uint8_t) size_classes_n;
+        }
+        header->size      = (uint32_t) size;
+        header->subsystem = (uint8_t) subsystem;
+
+        auto& c         = counters[(size_t) subsystem];
+        const auto live = c.bytes_live.fetch_add((int64_t) size, std::memory_order_relaxed) + (int64_t) size;
+        auto peak       = c.bytes_peak.load(std::memory_order_relaxed);
+        while (live > peak && !c.bytes_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            ;
+        c.blocks_live.fetch_add(1, std::memory_order_relaxed);
+        c.allocations.fetch_add(1, std::memory_order_relaxed);
+
+        return header + 1;
+    }
+
+    void deallocate(void* block)
+    {
+        if (!block)
+            return;
+        auto* header = (Header*) block - 1;
+
+        auto& c = counters[header->subsystem];
+        c.bytes_live.fetch_sub(header->size, std::memory_order_relaxed);
+        c.blocks_live.fetch_sub(1, std::memory_order_relaxed);
+
+        if (header->size_class == size_classes_n)
+        {
+            free(header);
+            return;
+        }
+        // back to the shard it came from, the link overwrites the header
+        const auto index = header->size_class;
+        auto& shard      = shards[header->shard];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        *(void**) header        = shard.free_lists[index];
+        shard.free_lists[index] = header;
+    }
+
+    void* reallocate(void* block, size_t new_size)
+    {
+        if (!block)
+            return allocate(new_size);
+
+        const auto* header = (Header*) block - 1;
+        // still fits its size class, and stays in its subsystem
+        if (header->size_class < size_classes_n && new_size <= (size_t(16) << header->size_class))
+        {
+            const auto delta = (int64_t) new_size - (int64_t) header->size;
+            auto& c          = counters[header->subsystem];
+            const auto live  = c.bytes_live.fetch_add(delta, std::memory_order_relaxed) + delta;
+            auto peak        = c.bytes_peak.load(std::memory_order_relaxed);
+            while (live > peak && !c.bytes_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+                ;
+            ((Header*) header)->size = (uint32_t) new_size;
+            return block;
+        }
+
+        void* moved = allocate(new_size);
+        if (!moved)
+            return nullptr;
+        memcpy(moved, block, std::min<size_t>(header->size, new_size));
+        deallocate(block);
+        return moved;
+    }
+
+    void print_stats(FILE* out = stdout) const
+    {
+        fprintf(out, "----freetype memory----\n");
+        fprintf(out, "%-12s %12s %12s %10s %12s %10s\n", "subsystem", "live kB", "peak kB", "blocks", "allocs", "pooled");
+        for (size_t i = 0; i < (size_t) Subsystem::count; ++i)
+        {
+            const auto& c = counters[i];
+            fprintf(
+                out,
+                "%-12s %12.1f %12.1f %10lld %12llu %10llu\n",
+                subsystem_names[i],
+                c.bytes_live.load() / 1024.0,
+                c.bytes_peak.load() / 1024.0,
+                (long long) c.blocks_live.load(),
+                (unsigned long long) c.allocations.load(),
+                (unsigned long long) c.pooled.load()
+            );
+        }
+    }
+
+    FT_MemoryRec_ memory {};
+    Counters counters[(size_t) Subsystem::count];
+    Shard shards[shards_n];
+
+private:
+    static size_t thread_shard()
+    {
+        thread_local size_t shard = std::hash<std::thread::id>()(std::this_thread::get_id()) % shards_n;
+        return shard;
+    }
+
+    // takes a block of the size class off the free list, carving a new chunk when it's empty
+    static Header* pop(Shard& shard, size_t index)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (!shard.free_lists[index])
+        {
+            const auto stride = class_size(index);
+            auto* chunk       = (char*) malloc(stride * blocks_per_chunk);
+            if (!chunk)
+                return nullptr;
+            shard.chunks.push_back(chunk);
+            for (size_t i = 0; i < blocks_per_chunk; ++i)
+            {
+                *(void**) (chunk + i * stride) = shard.free_lists[index];
+                shard.free_lists[index]        = chunk + i * stride;
+            }
+        }
+        auto* header            = (Header*) shard.free_lists[index];
+        shard.free_lists[index] = *(void**) header;
+        return header;
+    }
+
+    static void* alloc_cb(FT_Memory memory, long size)
+    {
+        return ((Allocator*) memory->user)->allocate((size_t) size);
+    }
+
+    static void free_cb(FT_Memory memory, void* block) { ((Allocator*) memory->user)->deallocate(block); }
+
+    static void* realloc_cb(FT_Memory memory, long /*cur_size*/, long new_size, void* block)
+    {
+        return ((Allocator*) memory->user)->reallocate(block, (size_t) new_size);
+    }
+};
+} // namespace ft_memory
+} // namespace typesetting
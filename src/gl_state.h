@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <glad/glad.h>
+
+namespace gfx
+{
+
+/**
+ * Shadow of the GL state the renderer touches. Binds and toggles that wouldn't change anything
+ * are dropped before they reach the driver, and the calls are counted per frame:
+ * issued ones reach the driver, filtered ones were redundant.
+ *
+ * Assumes nothing else changes the same state behind its back; invalidate() forgets it all.
+ */
+struct GlState
+{
+    struct Counters
+    {
+        uint64_t issued   = 0;
+        uint64_t filtered = 0;
+    };
+
+    void use_program(GLuint program)
+    {
+        if (filter(program == cur_program))
+            return;
+        glUseProgram(program);
+        cur_program = program;
+    }
+
+    void bind_vertex_array(GLuint vao)
+    {
+        if (filter(vao == cur_vao))
+            return;
+        glBindVertexArray(vao);
+        cur_vao = vao;
+    }
+
+    void bind_array_buffer(GLuint buffer)
+    {
+        if (filter(buffer == cur_array_buffer))
+            return;
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        cur_array_buffer = buffer;
+    }
+
+    // texture unit 0 only, which is all the renderer uses
+    void bind_texture_array(GLuint texture)
+    {
+        if (filter(texture == cur_texture_array))
+            return;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        cur_texture_array = texture;
+    }
+
+    void set_capability(GLenum cap, bool enabled)
+    {
+        int* cached = cap == GL_BLEND ? &blend : cap == GL_CULL_FACE ? &cull_face : nullptr;
+        if (cached && filter(*cached == (int) enabled))
+            return;
+        enabled ? glEnable(cap) : glDisable(cap);
+        if (cached)
+            *cached = (int) enabled;
+        else
+            count();
+    }
+
+    void blend_func(GLenum src, GLenum dst)
+    {
+        if (filter(src == blend_src && dst == blend_dst))
+            return;
+        glBlendFunc(src, dst);
+        blend_src = src;
+        blend_dst = dst;
+    }
+
+    void depth_mask(bool enabled)
+    {
+        if (filter(depth_write == (int) enabled))
+            return;
+        glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+        depth_write = (int) enabled;
+    }
+
+    // for the calls without state to shadow (uploads, draws, uniforms)
+    void count(uint64_t calls = 1) { frame_counters.issued += calls; }
+
+    // after GL calls made elsewhere
+    void invalidate()
+    {
+        cur_program = cur_vao = cur_array_buffer = cur_texture_array = unknown;
+        blend_src = blend_dst = GL_NONE;
+        blend = cull_face = depth_write = -1;
+    }
+
+    void end_frame()
+    {
+        total_counters.issued += frame_counters.issued;
+        total_counters.filtered += frame_counters.filtered;
+        last_frame_counters = frame_counters;
+        frame_counters      = {};
+        frames++;
+    }
+
+    Counters total_counters;
+    Counters frame_counters;
+    Counters last_frame_counters;
+    uint64_t frames = 0;
+
+private:
+    // counts the call and tells whether it's redundant
+    bool filter(bool redundant)
+    {
+        redundant ? frame_counters.filtered++ : frame_counters.issued++;
+        return redundant;
+    }
+
+    // doesn't name an object, so the first call of each kind goes through
+    static constexpr GLuint unknown = ~0u;
+
+    GLuint cur_program       = unknown;
+    GLuint cur_vao           = unknown;
+    GLuint cur_array_buffer  = unknown;
+    GLuint cur_texture_array = unknown;
+    GLenum blend_src         = GL_NONE;
+    GLenum blend_dst         = GL_NONE;
+    // capabilities are -1 until set
+    int blend       = -1;
+    int cull_face   = -1;
+    int depth_write = -1;
+};
+
+// one GL context in this program
+inline GlState& gl_state()
+{
+    static GlState state;
+    return state;
+}
+
+} // namespace gfx
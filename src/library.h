@@ -2,9 +2,41 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H // Include FreeType header files
+#include FT_MODULE_H
+#include FT_SIZES_H
+#include <hb.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ft_memory.h"
+#include "mapped_file.h"
+#include "shape_plans.h"
 
 namespace typesetting
 {
+// A face opened once and shared by the fonts of all its sizes
+struct SharedFace
+{
+    FT_Face face      = nullptr;
+    FT_Size sdf_size  = nullptr; // glyphs are rasterized once per face
+    hb_face_t* tables = nullptr; // for the OpenType font functions
+    hb_font_t* parent = nullptr; // in font units, the sizes are its sub fonts
+    uint64_t hash     = 0;       // see snapshot::font_hash
+    unsigned face_id  = 0;       // Font::face_id of its sizes
+    int sizes_n       = 0;
+
+    // FreeType faces aren't thread safe, the shaping thread and the renderer lock the face to
+    // create sizes on it, rasterize and shape through hb_ft
+    std::unique_ptr<std::mutex> mutex = std::make_unique<std::mutex>();
+
+    // backs the face and the tables when opened from a file, or decompressed from the binary
+    std::unique_ptr<utlz::MappedFile> file;
+    std::vector<unsigned char> data;
+};
+
 // Memory handling and other resource mgmnt for fonts
 struct Library
 {
@@ -13,21 +45,52 @@ struct Library
         if (library)
             return true;
 
-        if (FT_Init_FreeType(&library))
+        allocator.init();
+        // FT_Init_FreeType, with our allocator
+        if (FT_New_Library(&allocator.memory, &library))
             return false;
+        FT_Add_Default_Modules(library);
+        FT_Set_Default_Properties(library);
 
         return true;
     }
 
     bool destroy()
     {
-        FT_Done_FreeType(library);
+        // the fonts of the faces must have been destroyed
+        for (auto& [key, shared] : faces)
+            destroy_face(shared);
+        faces.clear();
+
+        if (library)
+            FT_Done_Library(library);
         library = nullptr;
+        allocator.destroy();
 
         return true;
     }
 
+    void print_memory_stats(FILE* out = stdout) const { allocator.print_stats(out); }
+
+    static void destroy_face(SharedFace& shared)
+    {
+        if (shared.parent)
+            hb_font_destroy(shared.parent);
+        if (shared.tables)
+        {
+            shape_plans::forget_face(shared.tables);
+            hb_face_destroy(shared.tables);
+        }
+        // and its sizes
+        if (shared.face)
+            FT_Done_Face(shared.face);
+        shared = {};
+    }
+
     FT_Library get() const { return library; }
     FT_Library library { nullptr };
+    // by file path or blob address, see create_font
+    std::unordered_map<std::string, SharedFace> faces;
+    ft_memory::Allocator allocator;
 };
-} // namespace typesetting
\ No newline at end of file
+} // namespace typesetting
@@ -5,14 +5,11 @@
 #include "scope_guards.h"
 #include "text.h"
 #include "rendering.h"
+#include "shaping_thread.h"
 #include "test_strings.h"
 #include <future>
 #include <GLFW/glfw3.h>
 
-#include "fontbin/notosans_regular.h"
-#include "fontbin/notosans_emoji.h"
-#include "fontbin/notosans_math.h"
-
 // For testing and benchmarking
 #define RENDER_ENABLED 1
 
@@ -20,13 +17,13 @@ std::function<void(GLFWwindow*)> draw;
 
 static struct State
 {
-    std::atomic<bool> lorem_ipsums      = true;
-    std::atomic<bool> key_input         = true;
-    std::atomic<bool> has_input_changed = true;
+    std::atomic<bool> lorem_ipsums = true;
+    std::atomic<bool> key_input    = true;
 
     std::atomic<float> x_offset = 10, y_offset = 30;
 
-    std::vector<std::string> input = { "> " };
+    // the input text is edited and shaped there
+    typesetting::ShapingThread* shaping = nullptr;
 } state;
 
 void toggle(std::atomic_bool& b) { b.exchange(!b); }
@@ -35,9 +32,8 @@ void char_callback(GLFWwindow* window, unsigned int codepoint)
 {
     std::u32string u32;
     u32.push_back(codepoint);
-    auto utf8_str = utf8::utf32to8(u32);
-    state.input.at(0) += utf8_str;
-    state.has_input_changed = true;
+    using Kind = typesetting::EditEvent::Kind;
+    state.shaping->push({ Kind::Type, utf8::utf32to8(u32), profiling::now_ns() });
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
@@ -47,6 +43,14 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
     //    state.y_offset               = state.y_offset + delta_scale * yoffset;
 }
 
+void write_trace()
+{
+    if (profiling::write_trace(spec::trace_file))
+        fprintf(stdout, "trace written to %s\n", spec::trace_file);
+    else
+        fprintf(stderr, "writing trace to %s failed\n", spec::trace_file);
+}
+
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     if (action == GLFW_PRESS)
@@ -74,9 +78,23 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             // Handle paste operation (Ctrl+V)
             if (key == GLFW_KEY_V)
             {
-                const char* clipboard_text = glfwGetClipboardString(window);
-                state.input.emplace_back(clipboard_text);
-                state.has_input_changed = true;
+                using Kind = typesetting::EditEvent::Kind;
+                if (const char* clipboard_text = glfwGetClipboardString(window))
+                    state.shaping->push({ Kind::Paste, clipboard_text, profiling::now_ns() });
+            }
+
+            // profile so far
+            if (key == GLFW_KEY_P)
+            {
+                profiling::report();
+            }
+
+            // trace from now on, written out when toggled off
+            if (key == GLFW_KEY_T)
+            {
+                profiling::set_tracing(!profiling::is_tracing());
+                if (!profiling::is_tracing())
+                    write_trace();
             }
         }
 
@@ -90,6 +108,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 
 int main()
 {
+    profiling::set_thread_name("main");
 #if RENDER_ENABLED
     glfwSetErrorCallback([](auto err, auto desc) { fprintf(stderr, "ERROR: %s\n", desc); });
 #endif
@@ -153,7 +172,7 @@ int main()
     utlz::print_versions(library);
     TextRenderer rdr;
     {
-        bool status = rdr.init(4, 256);
+        bool status = rdr.init(4, 16384);
         check_failed(status, "Renderer init failed"); // 4 fonts and 256 max chars?
     }
     on_scope_exit([&] { rdr.destroy(); });
@@ -163,45 +182,33 @@ int main()
 
     const std::string font_dir = FONTS_DIR;
 
-    auto add_font_bin =
-        [&library,
-         content_scale](const unsigned char* font_bin, const unsigned int bin_size, int font_size = 32)
-    {
-        Font font;
-
-        auto _ = create_font_bin(&library, font_bin, bin_size, font_size, content_scale);
-        if (_)
-            font = _.value();
-        else
-            throw std::runtime_error("font failed");
-        return font;
-    };
+    // decompressed when itemization first falls back to it
+    auto add_font_embedded = [&library, content_scale](const char* name, int font_size = 32)
+    { return FontHandle::embedded(&library, name, font_size, content_scale); };
 
+    // created when itemization first falls back to it
     auto add_font = [&library, content_scale](const std::string font_path, int font_size = 32)
     {
-        Font font;
         if (!std::filesystem::exists(font_path))
             throw std::runtime_error("Error: Font file not found");
 
-        auto _ = create_font(&library, font_path.c_str(), font_size, content_scale);
-        if (_)
-            font = _.value();
-        else
-            throw std::runtime_error("font failed");
-        return font;
+        return FontHandle::file(&library, font_path, font_size, content_scale);
     };
 
-    auto font_latin = add_font_bin(fonts_NotoSans_Regular_ttf, fonts_NotoSans_Regular_ttf_len);
-    on_scope_exit([&] { destroy_font(font_latin); });
+    auto font_latin = add_font_embedded("NotoSans-Regular.ttf");
+    on_scope_exit([&] { font_latin.destroy(); });
+
+    auto font_mini = add_font_embedded("NotoSans-Regular.ttf", 16);
+    on_scope_exit([&] { font_mini.destroy(); });
 
-    auto font_mini = add_font_bin(fonts_NotoSans_Regular_ttf, fonts_NotoSans_Regular_ttf_len, 16);
-    on_scope_exit([&] { destroy_font(font_mini); });
+    // the atlas snapshot is matched to the fonts created before loading it
+    check_failed(font_latin.get() && font_mini.get(), "creating the embedded fonts failed");
 
-    auto font_emoji = add_font_bin(fonts_NotoEmoji_VariableFont_wght_ttf, fonts_NotoEmoji_VariableFont_wght_ttf_len);
-    on_scope_exit([&] { destroy_font(font_emoji); });
+    auto font_emoji = add_font_embedded("NotoEmoji-VariableFont_wght.ttf");
+    on_scope_exit([&] { font_emoji.destroy(); });
 
-    auto font_maths = add_font_bin(fonts_NotoSansMath_Regular_ttf, fonts_NotoSansMath_Regular_ttf_len);
-    on_scope_exit([&] { destroy_font(font_maths); });
+    auto font_maths = add_font_embedded("NotoSansMath-Regular.ttf");
+    on_scope_exit([&] { font_maths.destroy(); });
 
 #if __APPLE__
     auto font_fallback      = add_font("/Library/Fonts/Arial Unicode.ttf");
@@ -210,57 +217,65 @@ int main()
     auto font_fallback      = add_font("C:\\Windows\\Fonts\\segoeui.ttf");
     auto font_fallback_mini = add_font("C:\\Windows\\Fonts\\segoeui.ttf", 16);
 #endif
-    on_scope_exit([&] { destroy_font(font_fallback); });
-    on_scope_exit([&] { destroy_font(font_fallback_mini); });
+    on_scope_exit([&] { font_fallback.destroy(); });
+    on_scope_exit([&] { font_fallback_mini.destroy(); });
 
 #if 0
     auto font_latin = add_font(font_dir + "/NotoSans-Regular.ttf");
-    on_scope_exit([&] { destroy_font(font_latin); });
+    on_scope_exit([&] { font_latin.destroy(); });
     // arabic
     auto font_amiri = add_font(font_dir + "/amiri-regular.ttf");
-    on_scope_exit([&] { destroy_font(font_amiri); });
+    on_scope_exit([&] { font_amiri.destroy(); });
     auto font_arabic = add_font(font_dir + "/NotoSansArabic-Regular.ttf");
-    on_scope_exit([&] { destroy_font(font_arabic); });
+    on_scope_exit([&] { font_arabic.destroy(); });
     // hindi
     auto font_sanskrit = add_font(font_dir + "/Sanskrit2003.ttf");
-    on_scope_exit([&] { destroy_font(font_sanskrit); });
+    on_scope_exit([&] { font_sanskrit.destroy(); });
     auto font_sarabun = add_font(font_dir + "/Sarabun-Regular.ttf");
-    on_scope_exit([&] { destroy_font(font_sarabun); });
+    on_scope_exit([&] { font_sarabun.destroy(); });
     // russian
     auto font_dejavu = add_font(font_dir + "/DejaVuSerif.ttf");
-    on_scope_exit([&] { destroy_font(font_dejavu); });
+    on_scope_exit([&] { font_dejavu.destroy(); });
     // han
     auto font_han = add_font(font_dir + "/fireflysung.ttf");
-    on_scope_exit([&] { destroy_font(font_han); });
+    on_scope_exit([&] { font_han.destroy(); });
     // georgian
     auto font_georgian = add_font(font_dir + "/NotoSansGeorgian-VariableFont_wdthwght.ttf");
-    on_scope_exit([&] { destroy_font(font_georgian); });
+    on_scope_exit([&] { font_georgian.destroy(); });
     auto font_myanmar = add_font(font_dir + "/NotoSansMyanmar-Thin.ttf");
-    on_scope_exit([&] { destroy_font(font_myanmar); });
+    on_scope_exit([&] { font_myanmar.destroy(); });
     // ideograms
     auto font_simple_chinese = add_font(font_dir + "/NotoSansSC-VariableFont_wght.ttf");
-    on_scope_exit([&] { destroy_font(font_simple_chinese); });
+    on_scope_exit([&] { font_simple_chinese.destroy(); });
     auto font_katakana = add_font(font_dir + "/NotoSansJP-VariableFont_wght.ttf");
-    on_scope_exit([&] { destroy_font(font_katakana); });
+    on_scope_exit([&] { font_katakana.destroy(); });
     auto font_korean = add_font(font_dir + "/NotoSansKR-VariableFont_wght.ttf");
-    on_scope_exit([&] { destroy_font(font_korean); });
+    on_scope_exit([&] { font_korean.destroy(); });
     // other
     auto font_maths = add_font(font_dir + "/NotoSansMath-Regular.ttf");
-    on_scope_exit([&] { destroy_font(font_maths); });
+    on_scope_exit([&] { font_maths.destroy(); });
     auto font_emoji = add_font(font_dir + "/NotoEmoji-VariableFont_wght.ttf");
-    on_scope_exit([&] { destroy_font(font_emoji); });
+    on_scope_exit([&] { font_emoji.destroy(); });
     auto font_unifont = add_font(font_dir + "/unifont.ttf");
-    on_scope_exit([&] { destroy_font(font_unifont); });
+    on_scope_exit([&] { font_unifont.destroy(); });
 #endif
 
-    using V = std::vector<Font*>;
+    using V = std::vector<FontHandle*>;
     Font::Map mini_fonts;
     mini_fonts.add(HB_SCRIPT_LATIN, V { &font_mini });
     mini_fonts.set_fallback(V { &font_fallback_mini });
 
+    // fonts of the index are created when it picks them for a codepoint
+    IndexedFonts indexed_fonts;
+    if (!indexed_fonts.init(&library, spec::font_index_file, font_dir, 32, content_scale))
+        fprintf(stdout, "no font index loaded, falling back to the fixed fonts\n");
+    on_scope_exit([&] { indexed_fonts.destroy(); });
+
     Font::Map fonts;
     fonts.add(HB_SCRIPT_LATIN, V { &font_latin });
     fonts.set_fallback(V { &font_emoji, &font_maths, &font_fallback });
+    if (indexed_fonts.index.is_loaded())
+        fonts.set_indexed(&indexed_fonts);
 
 #if 0 // local testing with different variations
     // Works worse than arial somehow..
@@ -279,10 +294,24 @@ int main()
     //    fonts.add(HB_SCRIPT_MATH, V { &font_maths });
 #endif
 
+#if RENDER_ENABLED
+    {
+        auto loaded = utlz::time_in_mcrs(
+            "atlas load",
+            [&] { return rdr.load_snapshot(spec::atlas_snapshot_file); }
+        );
+        if (!loaded)
+            fprintf(stdout, "no atlas snapshot loaded, glyphs are rasterized on demand\n");
+    }
+#endif
+
     {
-        STOPWATCH("test");
+        PROFILE_ZONE("fonts_setup");
         fonts.add(HB_SCRIPT_LATIN, V { &font_latin });
         fonts.set_fallback(V { &font_emoji, &font_maths, &font_fallback });
+        // the shape plans are compiled here rather than by the first frame shaping a script
+        fonts.warm_up_shape_plans();
+        mini_fonts.warm_up_shape_plans();
     }
 
     using P            = std::pair<const char*, const char*>;
@@ -338,11 +367,52 @@ test::adhoc::all_part3,*/
     std::string s(test::adhoc::zalgo);
     auto zalgo_run = utlz::time_in_mcrs("zalgo", create_shapers, s, mini_fonts);
 
-    std::vector<ShaperRun> input_runs;
+    // from here on only the shaping thread creates the fonts of the map
+    ShapingThread shaping;
+#if RENDER_ENABLED
+    // the typed glyphs are rasterized on the shaping thread, frames only upload them
+    auto prepare_glyphs = [&rdr](const ShaperRun& run) { rdr.prepare_glyphs(run); };
+#else
+    std::function<void(const ShaperRun&)> prepare_glyphs;
+#endif
+    check_failed(
+        shaping.init(&fonts, { "> " }, [] { glfwPostEmptyEvent(); }, prepare_glyphs),
+        "shaping thread init failed"
+    );
+    on_scope_exit([&] { shaping.destroy(); });
+    state.shaping = &shaping;
+
+    // the snapshot drawn, kept until a newer one replaces it
+    std::unique_ptr<ShapedInput> input;
+    bool input_changed = false;
+
+#if RENDER_ENABLED
+    // the shaped texts are retained, so that scrolling only moves them
+    std::vector<TextBlock> lorem_blocks(all_runs.size());
+    for (size_t i = 0; i < all_runs.size(); ++i)
+    {
+        check_failed(lorem_blocks[i].init(), "text block init failed");
+        lorem_blocks[i].set_run(&all_runs[i], colours::black);
+    }
+    TextBlock zalgo_block;
+    check_failed(zalgo_block.init(), "text block init failed");
+    zalgo_block.set_run(&zalgo_run, colours::blue);
+    std::vector<TextBlock> input_blocks;
+    on_scope_exit(
+        [&]
+        {
+            for (auto* blocks : { &lorem_blocks, &input_blocks })
+                for (auto& block : *blocks)
+                    block.destroy();
+            zalgo_block.destroy();
+        }
+    );
+#endif
 
     Point p { 0, 0 };
     draw = [&](GLFWwindow* window)
     {
+        PROFILE_ZONE("frame");
         int fb_w = 0, fb_h = 0;
         glfwGetFramebufferSize(window, &fb_w, &fb_h);
         glViewport(0, 0, fb_w, fb_h);
@@ -357,13 +427,9 @@ test::adhoc::all_part3,*/
         float y = state.y_offset;
         if (state.lorem_ipsums)
         {
-            for (auto& runs : all_runs)
+            for (auto& block : lorem_blocks)
             {
-                rdr.draw_runs<VertexDataFormat>(
-                    runs,
-                    { DP_X(x * content_scale), DP_Y(y * content_scale) },
-                    colours::black
-                );
+                rdr.draw_block(block, { DP_X(x * content_scale), DP_Y(y * content_scale) });
                 y += 40.0f;
             }
             float zalgox, zalgoy;
@@ -373,46 +439,25 @@ test::adhoc::all_part3,*/
                 zalgox = ix - 100;
                 zalgoy = iy - 50;
             }
-            rdr.draw_runs<VertexDataFormat>(
-                zalgo_run,
-                { DP_X(zalgox * content_scale), DP_Y(zalgoy * content_scale) },
-                colours::blue
-            );
+            rdr.draw_block(zalgo_block, { DP_X(zalgox * content_scale), DP_Y(zalgoy * content_scale) });
         }
-        if (state.key_input)
+        // never waits, the previous snapshot is drawn while the next one is shaped
+        if (auto newer = shaping.take())
         {
-            if (state.has_input_changed)
-            {
-                input_runs.clear();
-                bool first = true;
-                for (auto& input_str : state.input)
-                {
-                    std::string label;
-                    if (first)
-                    {
-                        label = "key input";
-                        first = false;
-                    }
-                    else
-                        label = "pasted";
-
-                    std::stringstream counter;
-                    counter << label << "[" << std::setw(4) << std::to_string(input_str.size()) << "]";
-                    input_runs.emplace_back(
-                        utlz::time_in_mcrs(counter.str(), create_shapers, input_str, fonts)
-                    );
-                    std::cout << "glyphs[" << std::to_string(input_runs.back().total_glyphs_n) << "]\n";
-                }
-
-                state.has_input_changed = false;
-            }
-            for (auto& runs : input_runs)
+            for (size_t i = input_blocks.size(); i < newer->lines.size(); ++i)
+                check_failed(input_blocks.emplace_back().init(), "text block init failed");
+            // unchanged lines are shared with the previous snapshot, their blocks are kept
+            for (size_t i = 0; i < newer->lines.size(); ++i)
+                if (!input || i >= input->lines.size() || input->lines[i] != newer->lines[i])
+                    input_blocks[i].set_run(newer->lines[i].get(), colours::black);
+            input         = std::move(newer);
+            input_changed = true;
+        }
+        if (state.key_input && input)
+        {
+            for (size_t i = 0; i < input->lines.size(); ++i)
             {
-                rdr.draw_runs<VertexDataFormat>(
-                    runs,
-                    { DP_X(x * content_scale), DP_Y(y * content_scale) },
-                    colours::black
-                );
+                rdr.draw_block(input_blocks[i], { DP_X(x * content_scale), DP_Y(y * content_scale) });
                 y += 40.0f;
             }
         }
@@ -429,9 +474,21 @@ test::adhoc::all_part3,*/
     {
         draw(window);
         glfwSwapBuffers(window);
+        // from the keystroke to the frame showing it
+        if (input_changed && input->newest_edit_ns != 0)
+        {
+            PROFILE_SINCE("input_latency", input->newest_edit_ns);
+        }
+        input_changed = false;
         glfwWaitEvents();
     }
 
     rdr.print_stats();
+    library.print_memory_stats();
+    profiling::report();
+    if (profiling::is_tracing())
+        write_trace();
+    if (!rdr.export_snapshot(spec::atlas_snapshot_file))
+        fprintf(stderr, "exporting atlas snapshot failed\n");
     return 0;
 }
@@ -0,0 +1,379 @@
+#include "maxrects_binpack.h"
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include <cstdlib>
+#include <utility>
+
+namespace binpack
+{
+
+namespace
+{
+bool is_contained_in(const Rect& a, const Rect& b)
+{
+    return a.x >= b.x && a.y >= b.y && a.x + a.width <= b.x + b.width
+        && a.y + a.height <= b.y + b.height;
+}
+
+bool overlaps(const Rect& a, const Rect& b)
+{
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+bool same(const Rect& a, const Rect& b)
+{
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+void prune(std::vector<Rect>& rects)
+{
+    for (size_t i = 0; i < rects.size(); ++i)
+    {
+        for (size_t j = i + 1; j < rects.size(); ++j)
+        {
+            if (is_contained_in(rects[i], rects[j]))
+            {
+                rects.erase(rects.begin() + i);
+                --i;
+                break;
+            }
+            if (is_contained_in(rects[j], rects[i]))
+            {
+                rects.erase(rects.begin() + j);
+                --j;
+            }
+        }
+    }
+}
+} // namespace
+
+MaxRectsBinPack::MaxRectsBinPack()
+    : bin_width(0)
+    , bin_height(0)
+    , used_surface_area(0)
+{
+}
+
+MaxRectsBinPack::MaxRectsBinPack(int width, int height)
+    : bin_width(0)
+    , bin_height(0)
+    , used_surface_area(0)
+{
+    init(width, height);
+}
+
+void MaxRectsBinPack::init(int width, int height)
+{
+    assert(width > 0);
+    assert(height > 0);
+
+    bin_width  = width;
+    bin_height = height;
+
+    used_surface_area = 0;
+    used_rectangles.clear();
+    free_rectangles.clear();
+    new_free_rectangles.clear();
+    free_rectangles.push_back({ 0, 0, bin_width, bin_height });
+}
+
+void MaxRectsBinPack::restore(int width, int height, const Rect* free_list, int free_n, const Rect* used_list, int used_n)
+{
+    init(width, height);
+
+    free_rectangles.assign(free_list, free_list + free_n);
+    used_rectangles.assign(used_list, used_list + used_n);
+    for (const auto& rect : used_rectangles)
+        used_surface_area += rect.width * rect.height;
+}
+
+Rect MaxRectsBinPack::insert(int width, int height, FreeRectChoiceHeuristic method)
+{
+    int score1;
+    int score2;
+    Rect new_node;
+    switch (method)
+    {
+        case FreeRectChoiceHeuristic::BestShortSideFit:
+            new_node = find_position_for_new_node_best_short_side_fit(width, height, score1, score2);
+            break;
+        case FreeRectChoiceHeuristic::BottomLeft:
+            new_node = find_position_for_new_node_bottom_left(width, height, score1, score2);
+            break;
+    }
+
+    if (new_node.height == 0)
+        return new_node;
+
+    place_rect(new_node);
+    used_rectangles.push_back(new_node);
+    used_surface_area += width * height;
+
+    return new_node;
+}
+
+void MaxRectsBinPack::free(const Rect& rect)
+{
+    free(&rect, 1);
+}
+
+void MaxRectsBinPack::free(const Rect* rects, int rects_n)
+{
+    if (rects_n == 0)
+        return;
+
+    for (int i = 0; i < rects_n; ++i)
+    {
+        const auto& rect = rects[i];
+        assert(rect.width > 0 && rect.height > 0);
+        assert(rect.x + rect.width <= bin_width);
+        assert(rect.y + rect.height <= bin_height);
+
+        auto used = std::find_if(
+            used_rectangles.begin(),
+            used_rectangles.end(),
+            [&rect](const Rect& r) { return same(r, rect); }
+        );
+        assert(used != used_rectangles.end());
+        if (used == used_rectangles.end())
+            continue;
+        *used = used_rectangles.back();
+        used_rectangles.pop_back();
+        used_surface_area -= rect.width * rect.height;
+    }
+
+    auto overlaps_freed = [&](const Rect& r)
+    {
+        for (int i = 0; i < rects_n; ++i)
+            if (overlaps(r, rects[i]))
+                return true;
+        return false;
+    };
+
+    // The free rectangles that became maximal all overlap a freed one, the others stay as they
+    // are. Splitting the bin by the used rectangles gives the maximal free rectangles, and as
+    // splitting only shrinks them, the pieces away from the freed area can be dropped right away.
+    // The used rectangles nearest to the freed ones split first, so that few pieces are left for
+    // the rest to split.
+    auto gap = [&](const Rect& r)
+    {
+        int nearest = std::numeric_limits<int>::max();
+        for (int i = 0; i < rects_n; ++i)
+        {
+            const auto& f = rects[i];
+            const int dx  = std::max({ 0, f.x - (r.x + r.width), r.x - (f.x + f.width) });
+            const int dy  = std::max({ 0, f.y - (r.y + r.height), r.y - (f.y + f.height) });
+            nearest       = std::min(nearest, dx + dy);
+        }
+        return nearest;
+    };
+    std::vector<std::pair<int, const Rect*>> obstacles;
+    obstacles.reserve(used_rectangles.size());
+    for (const auto& used : used_rectangles)
+        obstacles.emplace_back(gap(used), &used);
+    std::sort(
+        obstacles.begin(),
+        obstacles.end(),
+        [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; }
+    );
+
+    std::vector<Rect> around { { 0, 0, bin_width, bin_height } };
+    for (const auto& [_, obstacle] : obstacles)
+    {
+        const auto& used = *obstacle;
+        bool split = false;
+        for (size_t i = 0; i < around.size();)
+        {
+            if (split_free_node(around[i], used))
+            {
+                around[i] = around.back();
+                around.pop_back();
+                split = true;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        if (!split)
+            continue;
+
+        for (const auto& piece : new_free_rectangles)
+            if (overlaps_freed(piece))
+                around.push_back(piece);
+        new_free_rectangles.clear();
+        prune(around);
+    }
+
+    add_free_rects(around);
+}
+
+bool MaxRectsBinPack::can_fit(int width, int height) const
+{
+    for (const auto& free_rect : free_rectangles)
+        if (free_rect.width >= width && free_rect.height >= height)
+            return true;
+
+    return false;
+}
+
+float MaxRectsBinPack::occupancy() const
+{
+    return (float) used_surface_area / (bin_width * bin_height);
+}
+
+Rect MaxRectsBinPack::find_position_for_new_node_best_short_side_fit(
+    int width,
+    int height,
+    int& best_short_side_fit,
+    int& best_long_side_fit
+) const
+{
+    Rect best_node { 0, 0, 0, 0 };
+    best_short_side_fit = std::numeric_limits<int>::max();
+    best_long_side_fit  = std::numeric_limits<int>::max();
+
+    for (const auto& free_rect : free_rectangles)
+    {
+        if (free_rect.width < width || free_rect.height < height)
+            continue;
+
+        int leftover_horiz = std::abs(free_rect.width - width);
+        int leftover_vert  = std::abs(free_rect.height - height);
+        int short_side_fit = std::min(leftover_horiz, leftover_vert);
+        int long_side_fit  = std::max(leftover_horiz, leftover_vert);
+
+        if (short_side_fit < best_short_side_fit
+            || (short_side_fit == best_short_side_fit && long_side_fit < best_long_side_fit))
+        {
+            best_node           = { free_rect.x, free_rect.y, width, height };
+            best_short_side_fit = short_side_fit;
+            best_long_side_fit  = long_side_fit;
+        }
+    }
+
+    return best_node;
+}
+
+Rect MaxRectsBinPack::find_position_for_new_node_bottom_left(int width, int height, int& best_y, int& best_x) const
+{
+    Rect best_node { 0, 0, 0, 0 };
+    best_y = std::numeric_limits<int>::max();
+    best_x = std::numeric_limits<int>::max();
+
+    for (const auto& free_rect : free_rectangles)
+    {
+        if (free_rect.width < width || free_rect.height < height)
+            continue;
+
+        int top_side_y = free_rect.y + height;
+        if (top_side_y < best_y || (top_side_y == best_y && free_rect.x < best_x))
+        {
+            best_node = { free_rect.x, free_rect.y, width, height };
+            best_y    = top_side_y;
+            best_x    = free_rect.x;
+        }
+    }
+
+    return best_node;
+}
+
+void MaxRectsBinPack::place_rect(const Rect& node)
+{
+    for (size_t i = 0; i < free_rectangles.size();)
+    {
+        if (split_free_node(free_rectangles[i], node))
+        {
+            free_rectangles[i] = free_rectangles.back();
+            free_rectangles.pop_back();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    add_free_rects(new_free_rectangles);
+    new_free_rectangles.clear();
+}
+
+bool MaxRectsBinPack::split_free_node(const Rect& free_node, const Rect& used_node)
+{
+    // Test with SAT if the rectangles even intersect.
+    if (used_node.x >= free_node.x + free_node.width || used_node.x + used_node.width <= free_node.x
+        || used_node.y >= free_node.y + free_node.height || used_node.y + used_node.height <= free_node.y)
+        return false;
+
+    if (used_node.x < free_node.x + free_node.width && used_node.x + used_node.width > free_node.x)
+    {
+        // New node at the top side of the used node.
+        if (used_node.y > free_node.y && used_node.y < free_node.y + free_node.height)
+        {
+            Rect new_node   = free_node;
+            new_node.height = used_node.y - new_node.y;
+            new_free_rectangles.push_back(new_node);
+        }
+
+        // New node at the bottom side of the used node.
+        if (used_node.y + used_node.height < free_node.y + free_node.height)
+        {
+            Rect new_node   = free_node;
+            new_node.y      = used_node.y + used_node.height;
+            new_node.height = free_node.y + free_node.height - (used_node.y + used_node.height);
+            new_free_rectangles.push_back(new_node);
+        }
+    }
+
+    if (used_node.y < free_node.y + free_node.height && used_node.y + used_node.height > free_node.y)
+    {
+        // New node at the left side of the used node.
+        if (used_node.x > free_node.x && used_node.x < free_node.x + free_node.width)
+        {
+            Rect new_node  = free_node;
+            new_node.width = used_node.x - new_node.x;
+            new_free_rectangles.push_back(new_node);
+        }
+
+        // New node at the right side of the used node.
+        if (used_node.x + used_node.width < free_node.x + free_node.width)
+        {
+            Rect new_node  = free_node;
+            new_node.x     = used_node.x + used_node.width;
+            new_node.width = free_node.x + free_node.width - (used_node.x + used_node.width);
+            new_free_rectangles.push_back(new_node);
+        }
+    }
+
+    return true;
+}
+
+void MaxRectsBinPack::add_free_rects(std::vector<Rect>& added)
+{
+    prune(added);
+
+    // the free rectangles are maximal among themselves, only the added ones are tested
+    auto contained_in_added = [&added](const Rect& r)
+    {
+        for (const auto& a : added)
+            if (is_contained_in(r, a))
+                return true;
+        return false;
+    };
+    free_rectangles.erase(
+        std::remove_if(free_rectangles.begin(), free_rectangles.end(), contained_in_added),
+        free_rectangles.end()
+    );
+
+    const size_t free_n = free_rectangles.size();
+    for (const auto& a : added)
+    {
+        bool contained = false;
+        for (size_t i = 0; i < free_n && !contained; ++i)
+            contained = is_contained_in(a, free_rectangles[i]);
+        if (!contained)
+            free_rectangles.push_back(a);
+    }
+}
+
+} // namespace binpack
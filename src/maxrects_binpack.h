@@ -0,0 +1,92 @@
+/** @file maxrects_binpack.h
+@author Jukka Jylänki
+
+@brief Implements the MAXRECTS data structure and the best short side fit packing heuristic.
+
+ Extended with rectangle deallocation: the packer keeps the used rectangles, and freeing recomputes
+ the maximal free rectangles over the freed area, so single glyphs can be evicted from an atlas
+ without clearing it.
+
+ This work is released to Public Domain, do whatever you want with it.
+         */
+#pragma once
+
+#include <vector>
+
+#include "skyline_binpack.h"
+
+namespace binpack
+{
+
+/** MaxRectsBinPack keeps track of the maximal free rectangles of the bin. Unlike the skyline packer,
+ * it can give back the area of individual rectangles with free.
+ */
+class MaxRectsBinPack
+{
+public:
+    /// Specifies the different heuristic rules that can be used when deciding where to place a new rectangle.
+    enum class FreeRectChoiceHeuristic
+    {
+        BestShortSideFit, ///< Positions the rectangle against the short side of a free rectangle into which it fits the best.
+        BottomLeft        ///< Does the Tetris placement, good for rectangles inserted sorted by height.
+    };
+
+    /// Instantiates a bin of size (0,0). Call init to create a new bin.
+    MaxRectsBinPack();
+
+    /// Instantiates a bin of the given size.
+    MaxRectsBinPack(int width, int height);
+
+    /// (Re)initializes the packer to an empty bin of width x height units. Call whenever
+    /// you need to restart with a new bin.
+    void init(int width, int height);
+
+    /// Inserts a single rectangle into the bin. Returns a rect of zero height if it didn't fit.
+    Rect insert(int width, int height, FreeRectChoiceHeuristic method = FreeRectChoiceHeuristic::BestShortSideFit);
+
+    /// Gives the area of a previously inserted rectangle back to the bin.
+    void free(const Rect& rect);
+
+    /// Gives the areas of previously inserted rectangles back to the bin at once, the free list is
+    /// recomputed and pruned once for all of them.
+    void free(const Rect* rects, int rects_n);
+
+    /// Tests if a rectangle of the given size would fit without inserting it.
+    bool can_fit(int width, int height) const;
+
+    /// Computes the ratio of used surface area to the total bin area.
+    float occupancy() const;
+
+    /// Restores the bin from a previously saved free list (see free_rects) and the rectangles
+    /// inserted into it.
+    void restore(int width, int height, const Rect* free_list, int free_n, const Rect* used_list, int used_n);
+
+    const std::vector<Rect>& free_rects() const { return free_rectangles; }
+
+    unsigned long used_area() const { return used_surface_area; }
+
+private:
+    int bin_width;
+    int bin_height;
+
+    unsigned long used_surface_area;
+
+    std::vector<Rect> used_rectangles;
+    std::vector<Rect> free_rectangles;
+    std::vector<Rect> new_free_rectangles;
+
+    Rect find_position_for_new_node_best_short_side_fit(int width, int height, int& best_short_side_fit, int& best_long_side_fit) const;
+
+    Rect find_position_for_new_node_bottom_left(int width, int height, int& best_y, int& best_x) const;
+
+    void place_rect(const Rect& node);
+
+    /// Splits free_node around used_node. Returns false if they didn't overlap.
+    bool split_free_node(const Rect& free_node, const Rect& used_node);
+
+    /// Adds candidate free rectangles, dropping the ones contained in another and the free
+    /// rectangles they contain.
+    void add_free_rects(std::vector<Rect>& added);
+};
+
+} // namespace binpack
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Profiling zones, replacing the stopwatch. PROFILE_ZONE("label") times the rest of the scope.
+ *
+ * Each thread writes its measurements into its own ring buffer without locks or shared writes,
+ * and report() drains all the rings into log bucketed histograms per zone, so that percentiles
+ * can be printed on demand while the program runs. A full ring drops the measurement and
+ * counts it, instead of blocking the thread.
+ *
+ * With tracing on, the drained measurements are also kept in a bounded ring, overwriting the
+ * oldest ones, which write_trace() exports as Chrome Trace Event JSON for Perfetto or
+ * chrome://tracing. Tracing can be toggled at runtime and stays cheap enough to leave enabled.
+ *
+ * Building with FONT_FRONT_PROFILING=0 removes the zones entirely.
+ */
+#ifndef FONT_FRONT_PROFILING
+    #define FONT_FRONT_PROFILING 1
+#endif
+
+namespace profiling
+{
+using Clock = std::chrono::steady_clock;
+
+inline uint64_t now_ns()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Event
+{
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t zone;
+    uint32_t frame;
+};
+
+// Single producer (the owning thread), single consumer (the reporter) ring
+struct ThreadBuffer
+{
+    static constexpr uint32_t capacity = 1 << 14;
+
+    bool push(const Event& event)
+    {
+        const auto head = write_pos.load(std::memory_order_relaxed);
+        if (head - read_pos.load(std::memory_order_acquire) == capacity)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events[head & (capacity - 1)] = event;
+        write_pos.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename F>
+    void drain(F&& f)
+    {
+        const auto tail = read_pos.load(std::memory_order_relaxed);
+        const auto head = write_pos.load(std::memory_order_acquire);
+        for (auto i = tail; i != head; ++i)
+            f(events[i & (capacity - 1)]);
+        read_pos.store(head, std::memory_order_release);
+    }
+
+    Event events[capacity];
+    alignas(64) std::atomic<uint64_t> write_pos { 0 };
+    alignas(64) std::atomic<uint64_t> read_pos { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    uint32_t thread_index = 0;
+};
+
+struct TraceEvent
+{
+    Event event;
+    uint32_t thread_index;
+};
+
+// Keeps the latest events, older ones are overwritten
+struct TraceRing
+{
+    void push(const TraceEvent& event)
+    {
+        if (events.empty())
+            return;
+        events[next % events.size()] = event;
+        next++;
+    }
+
+    size_t size() const { return std::min<uint64_t>(next, events.size()); }
+
+    template <typename F>
+    void for_each(F&& f) const
+    {
+        for (auto i = next - size(); i != next; ++i)
+            f(events[i % events.size()]);
+    }
+
+    std::vector<TraceEvent> events;
+    uint64_t next = 0;
+};
+
+// Durations in 4 buckets per power of two, which bounds the error of the percentiles to 19%
+struct Histogram
+{
+    static constexpr int sub_buckets = 4;
+    static constexpr int buckets_n   = 64 * sub_buckets;
+
+    static int bucket(uint64_t ns)
+    {
+        if (ns < sub_buckets)
+            return (int) ns;
+        int octave = 63;
+        while (!(ns >> octave))
+            --octave;
+        const int fraction = (int) ((ns >> (octave - 2)) & (sub_buckets - 1));
+        return (octave - 1) * sub_buckets + fraction;
+    }
+
+    // the largest duration in the bucket
+    static uint64_t upper_bound(int index)
+    {
+        if (index < sub_buckets)
+            return (uint64_t) index;
+        const int octave   = index / sub_buckets + 1;
+        const int fraction = index % sub_buckets;
+        return ((uint64_t) (sub_buckets + fraction + 1) << (octave - 2)) - 1;
+    }
+
+    void add(uint64_t ns)
+    {
+        counts[bucket(ns)]++;
+        count++;
+        sum += ns;
+        max = std::max(max, ns);
+    }
+
+    uint64_t percentile(double p) const
+    {
+        const auto rank = (uint64_t) (p * count + 0.5);
+        uint64_t seen   = 0;
+        for (int i = 0; i < buckets_n; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank && seen > 0)
+                return std::min(upper_bound(i), max);
+        }
+        return max;
+    }
+
+    uint64_t counts[buckets_n] {};
+    uint64_t count = 0;
+    uint64_t sum   = 0;
+    uint64_t max   = 0;
+};
+
+struct Registry
+{
+    std::mutex mutex; // zone and thread registration, and draining
+    std::vector<std::string> zones;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::vector<Histogram> histograms;
+    uint64_t dropped = 0;
+
+    uint32_t next_thread_index = 0;
+    std::unordered_map<uint32_t, std::string> thread_names;
+
+    TraceRing trace;
+    std::atomic<bool> tracing { false };
+    const uint64_t epoch_ns = now_ns();
+
+    std::atomic<uint32_t> frame { 0 };
+};
+
+inline Registry& registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+inline uint32_t register_zone(const char* label)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.zones.emplace_back(label);
+    r.histograms.emplace_back();
+    return (uint32_t) r.zones.size() - 1;
+}
+
+// the ring of the calling thread, shared with the registry so it outlives the thread until drained
+inline ThreadBuffer& thread_buffer()
+{
+    thread_local std::shared_ptr<ThreadBuffer> buffer = []
+    {
+        auto& r     = registry();
+        auto buffer = std::make_shared<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        buffer->thread_index = r.next_thread_index++;
+        r.buffers.push_back(buffer);
+        return buffer;
+    }();
+    return *buffer;
+}
+
+// names the calling thread in traces
+inline void set_thread_name(const char* name)
+{
+    const auto index = thread_buffer().thread_index;
+    auto& r          = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.thread_names[index] = name;
+}
+
+struct Zone
+{
+    explicit Zone(uint32_t _id)
+        : id(_id)
+        , start_ns(now_ns())
+    {
+    }
+
+    ~Zone()
+    {
+        thread_buffer().push(
+            { start_ns, now_ns() - start_ns, id, registry().frame.load(std::memory_order_relaxed) }
+        );
+    }
+
+    uint32_t id;
+    uint64_t start_ns;
+};
+
+// Measures from a start taken elsewhere, e.g. when an input event was made on another thread
+inline void record_since(uint32_t id, uint64_t start_ns)
+{
+    thread_buffer().push({ start_ns, now_ns() - start_ns, id, registry().frame.load(std::memory_order_relaxed) });
+}
+
+// Moves the pending measurements of all threads into the histograms. Must hold the mutex.
+inline void drain_locked(Registry& r)
+{
+    for (auto& buffer : r.buffers)
+    {
+        const bool tracing = r.tracing.load(std::memory_order_relaxed);
+        buffer->drain(
+            [&](const Event& event)
+            {
+                r.histograms[event.zone].add(event.duration_ns);
+                if (tracing)
+                    r.trace.push({ event, buffer->thread_index });
+            }
+        );
+        r.dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    // rings of the threads that have exited are empty now
+    r.buffers.erase(
+        std::remove_if(r.buffers.begin(), r.buffers.end(), [](auto& buffer) { return buffer.use_count() == 1; }),
+        r.buffers.end()
+    );
+}
+
+// Measurements are tagged with the frame they're made in. Drains the rings once per frame so that
+// they don't overflow between reports.
+inline void next_frame()
+{
+    auto& r = registry();
+    r.frame.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(r.mutex);
+    drain_locked(r);
+}
+
+// Starts or stops keeping the events for write_trace(), the ring is allocated on first use
+inline void set_tracing(bool enabled, size_t capacity = 1 << 18)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    // the events so far belong to the previous state
+    drain_locked(r);
+    if (enabled && r.trace.events.empty())
+        r.trace.events.resize(capacity);
+    r.tracing.store(enabled, std::memory_order_relaxed);
+}
+
+inline bool is_tracing() { return registry().tracing.load(std::memory_order_relaxed); }
+
+// Writes the traced events as Chrome Trace Event JSON and forgets them
+inline bool write_trace(const char* path)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    drain_locked(r);
+
+    FILE* out = fopen(path, "wb");
+    if (!out)
+        return false;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"font_front\"}}");
+    for (auto& [index, name] : r.thread_names)
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", index, name.c_str());
+
+    // complete events, a begin and an end in one
+    r.trace.for_each(
+        [&](const TraceEvent& e)
+        {
+            fprintf(
+                out,
+                ",\n{\"name\":\"%s\",\"cat\":\"font_front\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+                r.zones[e.event.zone].c_str(),
+                e.thread_index,
+                (e.event.start_ns - r.epoch_ns) / 1000.0,
+                e.event.duration_ns / 1000.0,
+                e.event.frame
+            );
+        }
+    );
+    fprintf(out, "\n]}\n");
+    r.trace.next = 0;
+
+    return fclose(out) == 0;
+}
+
+// Prints the zones measured so far, may be called at any time from any thread
+inline void report(FILE* out = stdout)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    drain_locked(r);
+
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    fprintf(out, "\n----profile (us)----\n");
+    fprintf(out, "%-18s %10s %12s %9s %9s %9s %9s %9s\n", "zone", "count", "total", "avg", "p50", "p90", "p99", "max");
+    for (size_t i = 0; i < r.zones.size(); ++i)
+    {
+        const auto& h = r.histograms[i];
+        if (h.count == 0)
+            continue;
+        fprintf(
+            out,
+            "%-18s %10llu %12.1f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+            r.zones[i].c_str(),
+            (unsigned long long) h.count,
+            us(h.sum),
+            us(h.sum) / h.count,
+            us(h.percentile(0.5)),
+            us(h.percentile(0.9)),
+            us(h.percentile(0.99)),
+            us(h.max)
+        );
+    }
+    if (r.dropped > 0)
+        fprintf(out, "dropped measurements: %llu\n", (unsigned long long) r.dropped);
+    fprintf(out, "\n");
+}
+
+// Forgets the measurements so far, e.g. after warming up
+inline void reset()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    drain_locked(r);
+    for (auto& h : r.histograms)
+        h = {};
+    r.dropped = 0;
+}
+} // namespace profiling
+
+#define PROFILING_CONCAT_(a, b) a##b
+#define PROFILING_CONCAT(a, b) PROFILING_CONCAT_(a, b)
+
+#if FONT_FRONT_PROFILING
+    // the zone is registered once, on first use
+    #define PROFILE_ZONE(label)                                                                   \
+        static const uint32_t PROFILING_CONCAT(profile_zone_id_, __LINE__) =                      \
+            profiling::register_zone(label);                                                      \
+        profiling::Zone PROFILING_CONCAT(profile_zone_, __LINE__)(PROFILING_CONCAT(profile_zone_id_, __LINE__))
+
+    // from the given start to now, into the zone of the label
+    #define PROFILE_SINCE(label, start_ns)                                                        \
+        static const uint32_t PROFILING_CONCAT(profile_zone_id_, __LINE__) =                      \
+            profiling::register_zone(label);                                                      \
+        profiling::record_since(PROFILING_CONCAT(profile_zone_id_, __LINE__), start_ns)
+#else
+    #define PROFILE_ZONE(label) (void) 0
+    #define PROFILE_SINCE(label, start_ns) (void) 0
+#endif
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+    #include <immintrin.h>
+    #define QUAD_KERNEL_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define QUAD_KERNEL_SSE2 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define QUAD_KERNEL_NEON 1
+#endif
+
+/**
+ * Quad emission for runs of glyphs. Glyphs are first resolved from the cache into a batch of
+ * structure of arrays, then the kernel converts the positions and writes the two triangles of
+ * each glyph lane-wise. It's free of GL so it can be benchmarked on its own.
+ *
+ * The output is the layout of VertexDataFormat: 6 vertices of x, y, u, v per glyph.
+ */
+namespace typesetting
+{
+namespace kernel
+{
+constexpr size_t batch_capacity   = 256;
+constexpr size_t floats_per_glyph = 6 * 4;
+
+// Resolved glyphs of one run item (single font scale), in pixels unless noted
+struct alignas(32) QuadBatch
+{
+    float pen_x[batch_capacity];      // pen position including the origin
+    float pen_y[batch_capacity];      //
+    int32_t offset_x[batch_capacity]; // 26.6 shaping offsets, truncated to pixels like the advances
+    int32_t offset_y[batch_capacity]; //
+    float bearing_x[batch_capacity];  // unscaled metrics at spec::sdf_glyph_size
+    float descent[batch_capacity];    // size.y - bearing.y
+    float w[batch_capacity];          //
+    float h[batch_capacity];          //
+    float u0[batch_capacity];         // pre-normalized atlas coordinates, v0 on the top row
+    float v0[batch_capacity];         //
+    float u1[batch_capacity];         //
+    float v1[batch_capacity];         //
+    int32_t tex_x[batch_capacity];    // atlas region in texels, sized w * h
+    int32_t tex_y[batch_capacity];    //
+    int32_t layer[batch_capacity];    // atlas page
+    size_t n = 0;
+};
+
+// corners of the quad in the order of the two triangles: top left, bottom left, bottom right,
+// top left, bottom right, top right
+inline void emit_triangles_scalar(const QuadBatch& b, size_t begin, size_t end, float scale, float* out)
+{
+    for (size_t i = begin; i < end; ++i, out += floats_per_glyph)
+    {
+        const float x0 = b.pen_x[i] + (float) (b.offset_x[i] / 64) + b.bearing_x[i] * scale;
+        const float y0 = b.pen_y[i] + (float) (b.offset_y[i] / 64) - b.descent[i] * scale;
+        const float x1 = x0 + b.w[i] * scale;
+        const float y1 = y0 + b.h[i] * scale;
+
+        const float quad[floats_per_glyph] = { x0, y1, b.u0[i], b.v0[i], x0, y0, b.u0[i], b.v1[i],
+                                               x1, y0, b.u1[i], b.v1[i], x0, y1, b.u0[i], b.v0[i],
+                                               x1, y0, b.u1[i], b.v1[i], x1, y1, b.u1[i], b.v0[i] };
+        for (size_t j = 0; j < floats_per_glyph; ++j)
+            out[j] = quad[j];
+    }
+}
+
+#if QUAD_KERNEL_SSE2
+// 4 glyphs per iteration, the corners are transposed from lanes into vertices
+inline void emit_triangles_sse2(const QuadBatch& b, size_t begin, size_t end, float scale, float* out)
+{
+    const __m128 s        = _mm_set1_ps(scale);
+    const __m128 to_pixel = _mm_set1_ps(1.0f / 64.0f);
+
+    // integer division truncates towards zero, as does the conversion of the exact quotient
+    auto offset = [&](const int32_t* ptr)
+    { return _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) ptr)), to_pixel))); };
+
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4, out += 4 * floats_per_glyph)
+    {
+        const __m128 pen_x = _mm_loadu_ps(b.pen_x + i);
+        const __m128 pen_y = _mm_loadu_ps(b.pen_y + i);
+
+        const __m128 x0 = _mm_add_ps(_mm_add_ps(pen_x, offset(b.offset_x + i)), _mm_mul_ps(_mm_loadu_ps(b.bearing_x + i), s));
+        const __m128 y0 = _mm_sub_ps(_mm_add_ps(pen_y, offset(b.offset_y + i)), _mm_mul_ps(_mm_loadu_ps(b.descent + i), s));
+        const __m128 x1 = _mm_add_ps(x0, _mm_mul_ps(_mm_loadu_ps(b.w + i), s));
+        const __m128 y1 = _mm_add_ps(y0, _mm_mul_ps(_mm_loadu_ps(b.h + i), s));
+
+        const __m128 u0 = _mm_loadu_ps(b.u0 + i), v0 = _mm_loadu_ps(b.v0 + i);
+        const __m128 u1 = _mm_loadu_ps(b.u1 + i), v1 = _mm_loadu_ps(b.v1 + i);
+
+        __m128 tl0 = x0, tl1 = y1, tl2 = u0, tl3 = v0;
+        __m128 bl0 = x0, bl1 = y0, bl2 = u0, bl3 = v1;
+        __m128 br0 = x1, br1 = y0, br2 = u1, br3 = v1;
+        __m128 tr0 = x1, tr1 = y1, tr2 = u1, tr3 = v0;
+        _MM_TRANSPOSE4_PS(tl0, tl1, tl2, tl3);
+        _MM_TRANSPOSE4_PS(bl0, bl1, bl2, bl3);
+        _MM_TRANSPOSE4_PS(br0, br1, br2, br3);
+        _MM_TRANSPOSE4_PS(tr0, tr1, tr2, tr3);
+
+        const __m128 tl[4] = { tl0, tl1, tl2, tl3 }, bl[4] = { bl0, bl1, bl2, bl3 };
+        const __m128 br[4] = { br0, br1, br2, br3 }, tr[4] = { tr0, tr1, tr2, tr3 };
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            float* v = out + lane * floats_per_glyph;
+            _mm_storeu_ps(v + 0, tl[lane]);
+            _mm_storeu_ps(v + 4, bl[lane]);
+            _mm_storeu_ps(v + 8, br[lane]);
+            _mm_storeu_ps(v + 12, tl[lane]);
+            _mm_storeu_ps(v + 16, br[lane]);
+            _mm_storeu_ps(v + 20, tr[lane]);
+        }
+    }
+
+    emit_triangles_scalar(b, i, end, scale, out);
+}
+#endif
+
+#if QUAD_KERNEL_AVX2
+// 8 glyphs per iteration, each 128 bit half of the transposed corners is a vertex
+inline void emit_triangles_avx2(const QuadBatch& b, size_t begin, size_t end, float scale, float* out)
+{
+    const __m256 s        = _mm256_set1_ps(scale);
+    const __m256 to_pixel = _mm256_set1_ps(1.0f / 64.0f);
+
+    auto offset = [&](const int32_t* ptr)
+    {
+        const __m256 value = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) ptr));
+        return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(value, to_pixel)));
+    };
+
+    // x, y, u, v lanes into the vertices of glyphs 0|4, 1|5, 2|6 and 3|7
+    auto transpose = [](__m256 x, __m256 y, __m256 u, __m256 v, __m256 (&vertices)[4])
+    {
+        const __m256 xy_lo = _mm256_unpacklo_ps(x, y), xy_hi = _mm256_unpackhi_ps(x, y);
+        const __m256 uv_lo = _mm256_unpacklo_ps(u, v), uv_hi = _mm256_unpackhi_ps(u, v);
+        vertices[0]        = _mm256_shuffle_ps(xy_lo, uv_lo, 0x44);
+        vertices[1]        = _mm256_shuffle_ps(xy_lo, uv_lo, 0xee);
+        vertices[2]        = _mm256_shuffle_ps(xy_hi, uv_hi, 0x44);
+        vertices[3]        = _mm256_shuffle_ps(xy_hi, uv_hi, 0xee);
+    };
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8, out += 8 * floats_per_glyph)
+    {
+        const __m256 pen_x = _mm256_loadu_ps(b.pen_x + i);
+        const __m256 pen_y = _mm256_loadu_ps(b.pen_y + i);
+
+        const __m256 x0 = _mm256_fmadd_ps(_mm256_loadu_ps(b.bearing_x + i), s, _mm256_add_ps(pen_x, offset(b.offset_x + i)));
+        const __m256 y0 = _mm256_fnmadd_ps(_mm256_loadu_ps(b.descent + i), s, _mm256_add_ps(pen_y, offset(b.offset_y + i)));
+        const __m256 x1 = _mm256_fmadd_ps(_mm256_loadu_ps(b.w + i), s, x0);
+        const __m256 y1 = _mm256_fmadd_ps(_mm256_loadu_ps(b.h + i), s, y0);
+
+        const __m256 u0 = _mm256_loadu_ps(b.u0 + i), v0 = _mm256_loadu_ps(b.v0 + i);
+        const __m256 u1 = _mm256_loadu_ps(b.u1 + i), v1 = _mm256_loadu_ps(b.v1 + i);
+
+        __m256 tl[4], bl[4], br[4], tr[4];
+        transpose(x0, y1, u0, v0, tl);
+        transpose(x0, y0, u0, v1, bl);
+        transpose(x1, y0, u1, v1, br);
+        transpose(x1, y1, u1, v0, tr);
+
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            float* v       = out + lane * floats_per_glyph;
+            const int reg  = lane & 3;
+            auto half      = [&](const __m256& value)
+            { return lane < 4 ? _mm256_castps256_ps128(value) : _mm256_extractf128_ps(value, 1); };
+            const __m128 a = half(tl[reg]), c = half(br[reg]);
+            _mm_storeu_ps(v + 0, a);
+            _mm_storeu_ps(v + 4, half(bl[reg]));
+            _mm_storeu_ps(v + 8, c);
+            _mm_storeu_ps(v + 12, a);
+            _mm_storeu_ps(v + 16, c);
+            _mm_storeu_ps(v + 20, half(tr[reg]));
+        }
+    }
+
+    emit_triangles_scalar(b, i, end, scale, out);
+}
+#endif
+
+#if QUAD_KERNEL_NEON
+// 4 glyphs per iteration, the interleaving stores do the transposing
+inline void emit_triangles_neon(const QuadBatch& b, size_t begin, size_t end, float scale, float* out)
+{
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4, out += 4 * floats_per_glyph)
+    {
+        // vcvtq_s32_f32 truncates towards zero like the integer division
+        auto offset = [](const int32_t* ptr)
+        { return vcvtq_f32_s32(vcvtq_s32_f32(vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(ptr)), 1.0f / 64.0f))); };
+
+        const float32x4_t pen_x = vld1q_f32(b.pen_x + i);
+        const float32x4_t pen_y = vld1q_f32(b.pen_y + i);
+
+        const float32x4_t x0 = vmlaq_n_f32(vaddq_f32(pen_x, offset(b.offset_x + i)), vld1q_f32(b.bearing_x + i), scale);
+        const float32x4_t y0 = vmlsq_n_f32(vaddq_f32(pen_y, offset(b.offset_y + i)), vld1q_f32(b.descent + i), scale);
+        const float32x4_t x1 = vmlaq_n_f32(x0, vld1q_f32(b.w + i), scale);
+        const float32x4_t y1 = vmlaq_n_f32(y0, vld1q_f32(b.h + i), scale);
+
+        const float32x4_t u0 = vld1q_f32(b.u0 + i), v0 = vld1q_f32(b.v0 + i);
+        const float32x4_t u1 = vld1q_f32(b.u1 + i), v1 = vld1q_f32(b.v1 + i);
+
+        float tl[16], bl[16], br[16], tr[16];
+        vst4q_f32(tl, (float32x4x4_t { { x0, y1, u0, v0 } }));
+        vst4q_f32(bl, (float32x4x4_t { { x0, y0, u0, v1 } }));
+        vst4q_f32(br, (float32x4x4_t { { x1, y0, u1, v1 } }));
+        vst4q_f32(tr, (float32x4x4_t { { x1, y1, u1, v0 } }));
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            float* v = out + lane * floats_per_glyph;
+            vst1q_f32(v + 0, vld1q_f32(tl + lane * 4));
+            vst1q_f32(v + 4, vld1q_f32(bl + lane * 4));
+            vst1q_f32(v + 8, vld1q_f32(br + lane * 4));
+            vst1q_f32(v + 12, vld1q_f32(tl + lane * 4));
+            vst1q_f32(v + 16, vld1q_f32(br + lane * 4));
+            vst1q_f32(v + 20, vld1q_f32(tr + lane * 4));
+        }
+    }
+
+    emit_triangles_scalar(b, i, end, scale, out);
+}
+#endif
+
+// widest kernel the build targets
+inline void emit_triangles(const QuadBatch& b, size_t begin, size_t end, float scale, float* out)
+{
+#if QUAD_KERNEL_AVX2
+    emit_triangles_avx2(b, begin, end, scale, out);
+#elif QUAD_KERNEL_SSE2
+    emit_triangles_sse2(b, begin, end, scale, out);
+#elif QUAD_KERNEL_NEON
+    emit_triangles_neon(b, begin, end, scale, out);
+#else
+    emit_triangles_scalar(b, begin, end, scale, out);
+#endif
+}
+
+inline const char* emit_triangles_isa()
+{
+#if QUAD_KERNEL_AVX2
+    return "avx2";
+#elif QUAD_KERNEL_SSE2
+    return "sse2";
+#elif QUAD_KERNEL_NEON
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+} // namespace kernel
+} // namespace typesetting
@@ -6,78 +6,72 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <deque>
+
 #include "spec.h"
 #include "text.h"
 #include "shader.h"
-#include "skyline_binpack.h"
+#include "maxrects_binpack.h"
+#include "atlas_snapshot.h"
+#include "concurrent_cache.h"
+#include "mapped_file.h"
 #include "utlz.h"
-
-static const char* shader_string_for_vertices = R"SHADER_INPUT(
-#version 330 core
-layout (location = 0) in vec4 vertex; // pos, tex
-out vec2 TexCoords;
-
-uniform mat4 projection;
-
-void main()
-{
-    gl_Position = projection * vec4(vertex.xy, 0.0, 1.0);
-    TexCoords = vertex.zw;
-}
-)SHADER_INPUT";
-
-static const char* shader_string_for_fragments = R"SHADER_INPUT(
-#version 330 core
-in vec2 TexCoords;
-out vec4 color;
-
-uniform sampler2D text;
-uniform vec3 textColor;
-
-void main()
-{
-    float y = texture(text, TexCoords).r;
-    if (y < 0.5)
-        discard;
-    y *= 1.45;
-    y = 1.0 / (1.0 + exp(-20.0 * (y - 0.76)));
-
-    vec4 sampled = vec4(1.0, 1.0, 1.0, y);
-    color = vec4(textColor, 1.0) * sampled;
-}
-)SHADER_INPUT";
+#include "vertex_formats.h"
+#include "gl_state.h"
+#include "quad_kernel.h"
 
 namespace typesetting
 {
 
-struct VertexDataFormat
-{
-    using base_t = float;
-    base_t data[spec::vertex_data::triangle_points_n][spec::vertex_data::pos_points_n];
-};
-
 using GlyphKey = std::pair<unsigned int, unsigned int>;
 
 struct Glyph
 {
-    glm::ivec2 size { 0, 0 };       // Size of glyph
+    glm::ivec2 size { 0, 0 };       // Size of glyph at spec::sdf_glyph_size
     glm::ivec2 bearing { 0, 0 };    // Offset from horizontal layout origin to left/top of glyph
     glm::ivec2 tex_offset { 0, 0 }; // Offset of glyph in texture atlas
+    glm::vec4 uv { 0, 0, 0, 0 };    // Normalized atlas region: left, top, right, bottom
     int tex_index        = -1;      // Texture atlas index
     unsigned int dyn_tex = 0;       // Texture atlas generation
 };
 
-using GlyphCache = std::unordered_map<GlyphKey, Glyph>;
+// Lookups don't lock, so threads other than the renderer's can read it, but only the render thread
+// creates glyphs, as placing them uploads to the atlas. The cache keeps the frame each glyph was
+// last drawn in, for LRU eviction.
+using GlyphCache = ConcurrentCache<GlyphKey, Glyph>;
+
+// An SDF glyph rasterized at spec::sdf_glyph_size, waiting for the render thread to place it
+struct GlyphBitmap
+{
+    glm::ivec2 size { 0, 0 };
+    glm::ivec2 bearing { 0, 0 };
+    std::vector<uint8_t> pixels; // size.x * size.y
+};
+
+// Rasterized on any thread, once per glyph, and dropped once placed
+using GlyphBitmapCache = ConcurrentCache<GlyphKey, std::shared_ptr<const GlyphBitmap>>;
+
+// normalized once when the glyph is placed instead of per drawn quad
+inline glm::vec4 atlas_uv(glm::ivec2 tex_offset, glm::ivec2 size)
+{
+    const float w = spec::atlas_texture_w, h = spec::atlas_texture_h;
+    return { tex_offset.x / w, tex_offset.y / h, (tex_offset.x + size.x) / w, (tex_offset.y + size.y) / h };
+}
 
+// A page of the glyph atlas, stored as one layer of the renderer's texture array. The texture
+// array is left bound after the updates, as it's the only texture drawn from.
 struct Atlas
 {
-    bool init(uint16_t w, uint16_t h)
+    bool init(uint16_t w, uint16_t h, unsigned int texture_array, int layer_index)
     {
         assert(w > 0);
         assert(h > 0);
+        assert(texture_array != 0);
 
-        width  = w;
-        height = h;
+        width   = w;
+        height  = h;
+        texture = texture_array;
+        layer   = layer_index;
 
         bin_packer.init(w, h);
 
@@ -86,26 +80,17 @@ struct Atlas
         if (!data)
             return false;
 
-        // generate texture
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
-
-        // set texture options
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        // the layer storage is uninitialized
+        clear();
 
         return true;
     }
 
+    // the texture array is owned by the renderer
     bool destroy()
     {
         free(data);
-        glDeleteTextures(1, &texture);
+        data = nullptr;
         return true;
     }
 
@@ -120,9 +105,9 @@ struct Atlas
 
         memset(data, 0, width * height * 1 * sizeof(uint8_t));
 
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, data);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        gl_state().bind_texture_array(texture);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_RED, GL_UNSIGNED_BYTE, data);
+        gl_state().count();
     };
 
     std::optional<Point> add_region(const Glyph& glyph, const uint8_t* glyph_data)
@@ -144,53 +129,204 @@ struct Atlas
         for (uint16_t i = 0; i < glyph_h; ++i)
             memcpy(data + ((rect.y + i) * width + rect.x), glyph_data + i * glyph_w, glyph_w);
 
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, glyph_w, glyph_h, GL_RED, GL_UNSIGNED_BYTE, glyph_data);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        gl_state().bind_texture_array(texture);
+        glTexSubImage3D(
+            GL_TEXTURE_2D_ARRAY, 0, rect.x, rect.y, layer, glyph_w, glyph_h, 1, GL_RED, GL_UNSIGNED_BYTE, glyph_data
+        );
+        gl_state().count();
 
         return { { rect.x, rect.y } };
     }
 
+    // replaces the page with prebaked pixels, rows below the given ones are cleared
+    void load_pixels(const uint8_t* pixels, uint16_t rows)
+    {
+        assert(rows <= height);
+        assert(data != nullptr);
+        assert(texture != 0);
+
+        memcpy(data, pixels, width * rows * 1 * sizeof(uint8_t));
+        memset(data + width * rows, 0, width * (height - rows) * 1 * sizeof(uint8_t));
+
+        gl_state().bind_texture_array(texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        gl_state().count(1 + (rows > 0) + (rows < height));
+        if (rows > 0)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, rows, 1, GL_RED, GL_UNSIGNED_BYTE, pixels);
+        if (rows < height)
+            glTexSubImage3D(
+                GL_TEXTURE_2D_ARRAY,
+                0,
+                0,
+                rows,
+                layer,
+                width,
+                height - rows,
+                1,
+                GL_RED,
+                GL_UNSIGNED_BYTE,
+                data + width * rows
+            );
+    }
+
+    static binpack::Rect region_of(const Glyph& glyph)
+    {
+        assert(glyph.size.x > 0);
+        assert(glyph.size.y > 0);
+
+        return { glyph.tex_offset.x, glyph.tex_offset.y, glyph.size.x, glyph.size.y };
+    }
+
+    // gives the regions back to the packer at once, the pixels are left to be overwritten
+    void remove_regions(const std::vector<binpack::Rect>& regions)
+    {
+        bin_packer.free(regions.data(), (int) regions.size());
+    }
+
     uint16_t width {};
     uint16_t height {};
-    binpack::SkylineBinPack bin_packer;
+    binpack::MaxRectsBinPack bin_packer;
     uint8_t* data {};
-    unsigned int texture {};
+    unsigned int texture {}; // texture array of all the pages
+    int layer {};
+};
+
+/**
+ * Text drawn the same way frame after frame. Its glyph instances stay in a buffer of its own, so
+ * drawing it is one draw call without any glyph work. They're regenerated only when the run or
+ * colour is set, or when a region of an atlas page they sample may have been overwritten.
+ * The instances are relative to the origin given at draw time, which is a uniform translation.
+ */
+struct TextBlock
+{
+    bool init()
+    {
+        glGenBuffers(1, &vbo);
+        glGenVertexArrays(1, &vao);
+
+        auto& gl = gl_state();
+        gl.bind_vertex_array(vao);
+        gl.bind_array_buffer(vbo);
+        VertexLayout<GlyphInstance>::set_attributes(0);
+        gl.bind_vertex_array(0);
+
+        return vbo != 0 && vao != 0;
+    }
+
+    bool destroy()
+    {
+        glDeleteBuffers(1, &vbo);
+        glDeleteVertexArrays(1, &vao);
+        vbo = vao = 0;
+        // the deleted names may be bound
+        gl_state().invalidate();
+        return true;
+    }
+
+    // the run has to outlive the block or be set again
+    void set_run(ShaperRun* shaper_run, Colour c)
+    {
+        run    = shaper_run;
+        colour = c;
+        stale  = true;
+    }
+
+    bool is_stale(const std::vector<unsigned int>& page_versions) const
+    {
+        if (stale || pages_versions.size() != page_versions.size())
+            return true;
+
+        for (size_t i = 0; i < page_versions.size(); ++i)
+            if ((pages_used & (1u << i)) && pages_versions[i] != page_versions[i])
+                return true;
+
+        return false;
+    }
+
+    ShaperRun* run {};
+    Colour colour {};
+
+    GLuint vbo {};
+    GLuint vao {};
+    GLsizei instances_n {};
+
+    bool stale = true;
+    uint32_t pages_used {}; // bit per atlas page
+    std::vector<unsigned int> pages_versions;
+
+    // the glyphs drawn are marked used once per frame, so that eviction passes them over
+    std::vector<GlyphKey> glyph_keys;
+    uint64_t marked_frame = 0;
 };
 
 struct GlRenderer
 {
+    // shaders and attribute bindings of one vertex format over the shared vertex buffer
+    struct Pipeline
+    {
+        ShaderProgram program;
+        GLuint vao {};
+        size_t record_size {};
+        bool per_glyph_colour {}; // and layer, otherwise they're uniforms
+        int (*set_attributes)(GLintptr) {};
+        void (*draw)(GLsizei) {};
+
+        // uniform locations are looked up once, -1 for the ones the format doesn't have
+        GLint projection_location {};
+        GLint atlas_size_location {};
+        GLint colour_location {};
+        GLint layer_location {};
+        GLint translation_location {};
+    };
+
     bool init(int textures_n, int def_max_quads)
     {
         assert(textures_n > 0 && textures_n <= 16);
-        assert(def_max_quads > 0 && def_max_quads <= 1024);
+        assert(def_max_quads > 0);
 
-        max_quads = def_max_quads;
+        const size_t record_size = std::max({ sizeof(VertexDataFormat), sizeof(CompactVertexFormat), sizeof(GlyphInstance) });
 
-        std::string errorLog;
-        if (!program.init(shader_string_for_vertices, shader_string_for_fragments, errorLog))
-            return false;
+        // a commit has to fit the ring
+        max_quads = std::min<GLsizeiptr>(def_max_quads, spec::vertex_data::ring_size / record_size);
 
-        glGenVertexArrays(1, &vao);
         glGenBuffers(1, &vbo);
-        glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, max_quads * sizeof(VertexDataFormat), nullptr, GL_DYNAMIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(
+        gl_state().bind_array_buffer(vbo);
+        glBufferData(GL_ARRAY_BUFFER, spec::vertex_data::ring_size, nullptr, GL_STREAM_DRAW);
+        ring_offset = 0;
+
+        if (!init_pipeline<VertexDataFormat>() || !init_pipeline<CompactVertexFormat>()
+            || !init_pipeline<GlyphInstance>())
+            return false;
+        gl_state().bind_array_buffer(0);
+
+        // all the atlas pages are layers of one texture, so page changes don't split the batches
+        glGenTextures(1, &texture_array);
+        glActiveTexture(GL_TEXTURE0);
+        gl_state().bind_texture_array(texture_array);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage3D(
+            GL_TEXTURE_2D_ARRAY,
+            0,
+            GL_R8,
+            spec::atlas_texture_w,
+            spec::atlas_texture_h,
+            textures_n,
             0,
-            spec::vertex_data::pos_points_n,
-            GL_FLOAT,
-            GL_FALSE,
-            spec::vertex_data::pos_points_n * sizeof(VertexDataFormat::base_t),
-            0
+            GL_RED,
+            GL_UNSIGNED_BYTE,
+            nullptr
         );
-        glBindVertexArray(0);
+
+        // set texture options
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
         if (!inherited_init(textures_n))
             return false;
 
-        vertices = (float*) malloc(max_quads * sizeof(VertexDataFormat));
+        vertices = (uint8_t*) malloc(max_quads * record_size);
         if (!vertices)
             return false;
 
@@ -200,7 +336,9 @@ struct GlRenderer
     bool destroy()
     {
         glDeleteBuffers(1, &vbo);
-        glDeleteVertexArrays(1, &vao);
+        glDeleteTextures(1, &texture_array);
+        for (auto& pipeline : pipelines)
+            glDeleteVertexArrays(1, &pipeline.vao);
         free(vertices);
 
         return true;
@@ -208,16 +346,19 @@ struct GlRenderer
 
     bool begin(int w, int h)
     {
-        glEnable(GL_CULL_FACE);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        auto& gl = gl_state();
+        gl.set_capability(GL_CULL_FACE, true);
+        gl.set_capability(GL_BLEND, true);
+        gl.blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        gl.depth_mask(false); // Don't write into the depth buffer
 
-        program.use(true);
+        frame++;
 
-        glm::mat4 projection = glm::ortho(0.0f, static_cast<float>(w), 0.0f, static_cast<float>(h));
-        glUniformMatrix4fv(program.get_uniform_location("projection"), 1, GL_FALSE, glm::value_ptr(projection));
-        glBindVertexArray(vao);
-        glActiveTexture(GL_TEXTURE0);
+        projection    = glm::ortho(0.0f, static_cast<float>(w), 0.0f, static_cast<float>(h));
+        clip          = { { 0.0f, 0.0f }, { static_cast<float>(w), static_cast<float>(h) } };
+        active_format = VertexFormatId::count;
+        gl.bind_array_buffer(vbo);
+        gl.bind_texture_array(texture_array);
 
         return true;
     }
@@ -226,62 +367,210 @@ struct GlRenderer
     {
         if (!cur_quad)
             return false;
-        glDepthMask(GL_FALSE); // Don't write into the depth buffer
-        // update content of VBO memory
-        glBufferSubData(GL_ARRAY_BUFFER, 0, cur_quad * sizeof(VertexDataFormat), vertices);
-        // render quad
-        glDrawArrays(GL_TRIANGLES, 0, cur_quad * spec::vertex_data::triangle_points_n);
-        glDepthMask(GL_TRUE); // Don't write into the depth buffer
+        PROFILE_ZONE("commit");
+
+        auto& pipeline = pipelines[(size_t) active_format];
+        const GLsizeiptr size = cur_quad * pipeline.record_size;
+        const GLintptr offset = stream_vertices(size, pipeline.record_size);
+        if (offset < 0)
+            return false;
+
+        // render quads from where they were streamed to
+        gl_state().count(pipeline.set_attributes(offset) + 1);
+        pipeline.draw((GLsizei) cur_quad);
 
         cur_quad = 0;
 
         return true;
     }
 
+    // leaves the state bound for the next frame, the shadow filters rebinding it
     void end()
     {
         commit();
-        glBindVertexArray(0);
-        program.use(false);
+        gl_state().depth_mask(true);
+        gl_state().end_frame();
+        profiling::next_frame();
+        active_format = VertexFormatId::count;
     }
 
+    // Switches the pipeline the following quads are drawn with
+    template <typename VertexDataType>
+    void use_format()
+    {
+        using Layout = VertexLayout<VertexDataType>;
+        if (active_format == Layout::id)
+            return;
+
+        commit();
+        active_format = Layout::id;
+
+        auto& pipeline = pipelines[(size_t) Layout::id];
+        auto& gl       = gl_state();
+        gl.use_program(pipeline.program.id());
+        gl.bind_vertex_array(pipeline.vao);
+        glUniformMatrix4fv(pipeline.projection_location, 1, GL_FALSE, glm::value_ptr(projection));
+        gl.count();
+        if constexpr (!Layout::per_glyph_colour)
+        {
+            glUniform3f(pipeline.colour_location, last_colour.x, last_colour.y, last_colour.z);
+            glUniform1i(pipeline.layer_location, last_layer);
+            gl.count(2);
+        }
+    }
+
+    // the colour is a uniform only for the formats without per glyph colour
     void set_colour(Colour c)
     {
-        if (last_colour != c)
-            commit();
+        if (active_format == VertexFormatId::count || pipelines[(size_t) active_format].per_glyph_colour)
+        {
+            last_colour = c;
+            return;
+        }
+
+        if (last_colour == c)
+            return;
 
-        glUniform3f(program.get_uniform_location("textColor"), c.x, c.y, c.z);
+        commit();
+
+        glUniform3f(pipelines[(size_t) active_format].colour_location, c.x, c.y, c.z);
+        gl_state().count();
         last_colour = c;
     }
 
-    void set_tex_id(unsigned int tex_id)
+    // the atlas page is a uniform only for the formats without per glyph layers
+    void set_layer(int layer)
+    {
+        if (active_format == VertexFormatId::count || pipelines[(size_t) active_format].per_glyph_colour)
+        {
+            last_layer = layer;
+            return;
+        }
+
+        if (layer == last_layer)
+            return;
+
+        commit();
+
+        glUniform1i(pipelines[(size_t) active_format].layer_location, layer);
+        gl_state().count();
+        last_layer = layer;
+    }
+
+    template <typename VertexDataType>
+    void append_quad(const VertexDataType& v)
     {
-        if (tex_id != last_tex_id)
+        assert(active_format == VertexLayout<VertexDataType>::id);
+        if (cur_quad == max_quads)
             commit();
 
-        glBindTexture(GL_TEXTURE_2D, tex_id);
-        last_tex_id = tex_id;
+        assert(cur_quad < max_quads);
+        memcpy(vertices + cur_quad * sizeof(VertexDataType), &v, sizeof(VertexDataType));
+        cur_quad++;
     }
 
 protected:
     virtual bool inherited_init(int) = 0;
 
-public:
-    VertexDataFormat::base_t* vertices;
+    // Appends the staged vertices to the ring past the ranges earlier draws may still read, so
+    // the write doesn't wait for the GPU. When the ring is full the storage is orphaned: the
+    // driver keeps the old one alive for the draws in flight and hands out a fresh one.
+    // Returns the offset of the vertices in the buffer.
+    GLintptr stream_vertices(GLsizeiptr size, size_t record_size)
+    {
+        GLintptr offset = (GLintptr) ((ring_offset + record_size - 1) / record_size * record_size);
+        if (offset + size > spec::vertex_data::ring_size)
+        {
+            glBufferData(GL_ARRAY_BUFFER, spec::vertex_data::ring_size, nullptr, GL_STREAM_DRAW);
+            gl_state().count();
+            buffers_orphaned++;
+            offset = 0;
+        }
+
+        void* ptr = glMapBufferRange(
+            GL_ARRAY_BUFFER,
+            offset,
+            size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT
+        );
+        if (!ptr)
+            return -1;
 
-    // vertex array and vertex buffer objects
-    GLuint vao, vbo;
+        memcpy(ptr, vertices, size);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        gl_state().count(2);
+
+        ring_offset = offset + size;
+        return offset;
+    }
+
+    template <typename VertexDataType>
+    bool init_pipeline()
+    {
+        using Layout   = VertexLayout<VertexDataType>;
+        auto& pipeline = pipelines[(size_t) Layout::id];
+
+        std::string errorLog;
+        if (!pipeline.program.init(Layout::vertex_shader, Layout::fragment_shader, errorLog))
+        {
+            fprintf(stderr, "%s\n", errorLog.c_str());
+            return false;
+        }
+
+        pipeline.record_size      = sizeof(VertexDataType);
+        pipeline.per_glyph_colour = Layout::per_glyph_colour;
+        pipeline.set_attributes = &Layout::set_attributes;
+        pipeline.draw           = &Layout::draw;
+
+        auto& program                = pipeline.program;
+        pipeline.projection_location = program.get_uniform_location("projection");
+        pipeline.atlas_size_location = program.get_uniform_location("atlas_size");
+        pipeline.colour_location     = program.get_uniform_location("textColor");
+        pipeline.layer_location      = program.get_uniform_location("layer");
+        pipeline.translation_location = program.get_uniform_location("translation");
+
+        // constant for the lifetime of the program, text blocks restore the translation
+        gl_state().use_program(program.id());
+        glUniform2f(pipeline.atlas_size_location, spec::atlas_texture_w, spec::atlas_texture_h);
+        glUniform2f(pipeline.translation_location, 0.0f, 0.0f);
+
+        glGenVertexArrays(1, &pipeline.vao);
+        gl_state().bind_vertex_array(pipeline.vao);
+        Layout::set_attributes(0);
+        gl_state().bind_vertex_array(0);
+
+        return true;
+    }
+
+public:
+    uint8_t* vertices {};
+
+    // vertex buffer ring shared by the pipelines
+    GLuint vbo {};
+    GLintptr ring_offset {};
+    Pipeline pipelines[(size_t) VertexFormatId::count];
+    VertexFormatId active_format = VertexFormatId::count;
+    glm::mat4 projection { 1.0f };
+    gfx::Aabb clip; // text outside isn't drawn, the framebuffer by default
     Colour last_colour;
 
-    unsigned int last_tex_id   = 0;
+    // atlas pages
+    unsigned int texture_array {};
+    int last_layer = 0;
+
     uint64_t textures_required = 0;
     uint64_t textures_hit      = 0;
     uint64_t textures_evicted  = 0;
-
-    GLsizeiptr max_quads;
-    GLsizeiptr cur_quad;
-
-    ShaderProgram program;
+    uint64_t glyphs_evicted    = 0;
+    uint64_t buffers_orphaned  = 0;
+    uint64_t blocks_drawn      = 0;
+    uint64_t blocks_built      = 0;
+    uint64_t blocks_culled     = 0;
+    uint64_t glyphs_culled     = 0;
+    uint64_t frame             = 0;
+
+    GLsizeiptr max_quads {};
+    GLsizeiptr cur_quad {};
 };
 
 // Passes shit to the shader
@@ -292,14 +581,17 @@ struct TextRenderer : GlRenderer
         for (int i = 0; i < textures_n; i++)
         {
             std::unique_ptr<Atlas> t = std::make_unique<Atlas>();
-            if (!t->init(spec::atlas_texture_w, spec::atlas_texture_h))
+            if (!t->init(spec::atlas_texture_w, spec::atlas_texture_h, texture_array, i))
                 return false;
 
             atlases.emplace_back(std::move(t));
             dyn_atlases.push_back(0);
+            page_versions.push_back(0);
+            evicted.emplace_back();
         }
 
         line.tex_index = -1;
+        render_thread  = std::this_thread::get_id();
 
         return true;
     }
@@ -307,159 +599,646 @@ struct TextRenderer : GlRenderer
     // adds and update glyph (returns revised version)
     Glyph add_to_atlas(Glyph glyph, const unsigned char* data)
     {
-        for (size_t i = 0; i < atlases.size(); ++i)
+        auto place = [&](size_t index) -> std::optional<Glyph>
         {
-            auto* atlas = atlases[i].get();
-            if (auto tex_offset_opt = atlas->add_region(glyph, data))
+            if (auto tex_offset_opt = atlases[index]->add_region(glyph, data))
             {
                 Glyph new_glyph      = glyph;
-                new_glyph.tex_index  = i;
-                new_glyph.dyn_tex    = dyn_atlases[i];
+                new_glyph.tex_index  = index;
+                new_glyph.dyn_tex    = dyn_atlases[index];
                 new_glyph.tex_offset = tex_offset_opt.value();
+                new_glyph.uv         = atlas_uv(new_glyph.tex_offset, new_glyph.size);
                 return new_glyph;
             }
-        }
+            return std::nullopt;
+        };
 
-        // evict a random choosed one
+        for (size_t i = 0; i < atlases.size(); ++i)
+            if (auto placed = place(i))
+                return placed.value();
+
+        // evict least recently used glyphs one by one until the new one fits in the freed space
+        if (auto evicted_into = evict_lru_glyphs(glyph))
+            if (auto placed = place(evicted_into.value()))
+                return placed.value();
+
+        // the free space is too fragmented: evict a random choosed page
         const auto index = (size_t) rand() % atlases.size();
-        auto* atlas      = atlases[index].get();
-        atlas->clear();
-        dyn_atlases[index]++;
-        textures_evicted++;
+        clear_atlas(index);
 
         // retry
-        if (auto tex_offset_opt = atlas->add_region(glyph, data))
-        {
-            Glyph new_glyph      = glyph;
-            new_glyph.tex_index  = index;
-            new_glyph.dyn_tex    = dyn_atlases[index];
-            new_glyph.tex_offset = tex_offset_opt.value();
-            return new_glyph;
-        }
+        if (auto placed = place(index))
+            return placed.value();
 
         throw std::runtime_error("Failed to add region for glyph");
     }
 
-    // Returns the glyph from cache creating it, if it doesn't exist
-    std::optional<std::reference_wrapper<Glyph>> cached_glyph(const Font& font, unsigned int glyph_index)
+    // Frees cached glyphs starting from the least recently used until there's room for the given
+    // glyph. Returns the atlas index that can fit it.
+    //
+    // The LRU queue is in the order the glyphs were placed or last found used: a glyph used since
+    // it was queued goes to the back instead of being evicted, and those used in this frame are
+    // never evicted. The regions of a page are freed together once they add up to the glyph.
+    std::optional<size_t> evict_lru_glyphs(const Glyph& glyph)
     {
-        STOPWATCH("cached_glyph");
-        GlyphKey key { font.id, glyph_index };
-        auto iter = glyphs.find(key);
-        // glyph exists in cache
-        if (iter != glyphs.end())
+        // pending quads may refer to the regions that will be overwritten
+        commit();
+
+        const int64_t needed = (int64_t) glyph.size.x * glyph.size.y;
+        std::vector<int64_t> freed_area(atlases.size(), 0);
+        std::optional<size_t> fits;
+
+        for (size_t visits = lru.size(); visits > 0 && !fits; --visits)
         {
-            auto& glyph = iter->second;
-            if (glyph.tex_index >= 0 && (glyph.dyn_tex == dyn_atlases[glyph.tex_index]))
+            const auto queued = lru.front();
+            lru.pop_front();
+
+            const auto cached = glyphs.peek(queued.key);
+            if (!cached || cached->first.tex_index != queued.page)
+                continue;
+            const auto& [placed, last_used] = *cached;
+            if (last_used > queued.used || last_used >= frame)
+            {
+                lru.push_back({ queued.key, last_used, queued.page });
+                continue;
+            }
+
+            const auto index = (size_t) queued.page;
+            evicted[index].push_back(Atlas::region_of(placed));
+            freed_area[index] += (int64_t) placed.size.x * placed.size.y;
+            glyphs.erase(queued.key);
+            glyphs_evicted++;
+
+            if (freed_area[index] >= needed)
             {
-                textures_required++;
-                textures_hit++;
+                free_evicted(index);
+                freed_area[index] = 0;
+                if (atlases[index]->bin_packer.can_fit(glyph.size.x, glyph.size.y))
+                    fits = index;
             }
-            return { glyph };
         }
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Disable byte-alignment restriction
+        for (size_t i = 0; i < atlases.size(); ++i)
+            free_evicted(i);
+        return fits;
+    }
+
+    void free_evicted(size_t index)
+    {
+        if (evicted[index].empty())
+            return;
+        atlases[index]->remove_regions(evicted[index]);
+        page_versions[index]++;
+        evicted[index].clear();
+    }
+
+    void clear_atlas(size_t index)
+    {
+        commit();
+
+        atlases[index]->clear();
+        dyn_atlases[index]++;
+        page_versions[index]++;
+        textures_evicted++;
+
+        glyphs.erase_if(
+            [index](const GlyphKey&, const Glyph& glyph, uint64_t) { return glyph.tex_index == (int) index; }
+        );
+        lru.erase(
+            std::remove_if(lru.begin(), lru.end(), [index](const Queued& q) { return q.page == (int) index; }),
+            lru.end()
+        );
+    }
+
+    // Returns the glyph from cache creating it, if it doesn't exist. Glyphs are shared by all the
+    // sizes of a face.
+    Glyph cached_glyph(const Font& font, unsigned int glyph_index)
+    {
+        PROFILE_ZONE("cached_glyph");
+        if (auto glyph = find_glyph(font, glyph_index))
+            return *glyph;
+
+        return create_glyph(font, glyph_index);
+    }
+
+    // Returns the cached glyph marking it used, if there's one
+    std::optional<Glyph> find_glyph(const Font& font, unsigned int glyph_index)
+    {
+        auto glyph = glyphs.find({ font.face_id, glyph_index }, frame);
+        if (glyph && glyph->tex_index >= 0 && (glyph->dyn_tex == dyn_atlases[glyph->tex_index]))
+        {
+            textures_required++;
+            textures_hit++;
+        }
+        return glyph;
+    }
+
+    // Places the glyph in the atlas, which may evict other glyphs. Only on the render thread, as it
+    // uploads the pixels. The bitmap is rasterized here unless another thread prepared it.
+    Glyph create_glyph(const Font& font, unsigned int glyph_index)
+    {
+        assert(std::this_thread::get_id() == render_thread);
+
+        const GlyphKey key { font.face_id, glyph_index };
+        const auto bitmap = bitmaps.get_or_create(key, [&] { return rasterize_glyph(font, glyph_index); });
+
+        Glyph glyph;
+        if (bitmap->size.x > 0 && bitmap->size.y > 0)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Disable byte-alignment restriction
+
+            glyph.size    = bitmap->size;
+            glyph.bearing = bitmap->bearing;
+            glyph         = add_to_atlas(glyph, bitmap->pixels.data());
+            lru.push_back({ key, frame, glyph.tex_index });
+            textures_required++;
+        }
+        font_hashes.emplace(font.face_id, font.hash);
+        glyphs.insert_or_assign(key, glyph, frame);
+
+        // the pixels are in the atlas now
+        bitmaps.erase(key);
+        return glyph;
+    }
+
+    // Rasterizes the glyph ahead of drawing it, on any thread. The render thread places it when
+    // it's first drawn, without waiting for FreeType.
+    void prepare_glyph(const Font& font, unsigned int glyph_index)
+    {
+        const GlyphKey key { font.face_id, glyph_index };
+        if (glyphs.find(key))
+            return;
+
+        bitmaps.get_or_create(key, [&] { return rasterize_glyph(font, glyph_index); });
+        // placed meanwhile, the bitmap wouldn't be asked for anymore
+        if (glyphs.find(key))
+            bitmaps.erase(key);
+    }
 
-        // glyph needs to be created
+    // e.g. from the shaping thread, for the lines it shaped
+    void prepare_glyphs(const ShaperRun& shaper_run)
+    {
+        PROFILE_ZONE("prepare_glyphs");
+        for (const auto& run : shaper_run.items)
+            for (const auto& info : run.hb_info)
+                prepare_glyph(*run.font, info.codepoint);
+    }
+
+    // Renders the SDF of the glyph, touches no GL nor renderer state
+    static std::shared_ptr<const GlyphBitmap> rasterize_glyph(const Font& font, unsigned int glyph_index)
+    {
+        PROFILE_ZONE("rasterize");
+        ft_memory::MemoryScope memory_scope(ft_memory::Subsystem::Rasterizer);
+        // fonts may be created on the face by the shaping thread
+        std::lock_guard<std::mutex> face_lock(*font.face_mutex);
+
+        // glyph needs to be created at the canonical size, restoring the shaping size afterwards
         auto face = font.face;
+        FT_Activate_Size(font.sdf_size);
+        on_scope_exit([&] { FT_Activate_Size(font.size); });
+
         if (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT))
             FT_Load_Glyph(face, 0, FT_LOAD_DEFAULT);
 
-        // TODO: use SDF
         if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF))
             throw std::runtime_error("Glyph render failed at: " + std::to_string(glyph_index));
 
-        // update atlas and update its info to the glyph
-        Glyph glyph;
-        auto* g = face->glyph;
+        auto bitmap = std::make_shared<GlyphBitmap>();
+        auto* g     = face->glyph;
         if (g->bitmap.width > 0 && g->bitmap.rows > 0)
         {
-            glyph.size    = { g->bitmap.width, g->bitmap.rows };
-            glyph.bearing = { g->bitmap_left, g->bitmap_top };
-            glyph         = add_to_atlas(glyph, g->bitmap.buffer);
-            textures_required++;
+            const int w     = (int) g->bitmap.width;
+            const int h     = (int) g->bitmap.rows;
+            bitmap->size    = { w, h };
+            bitmap->bearing = { g->bitmap_left, g->bitmap_top };
+            bitmap->pixels.resize((size_t) w * h);
+            for (int row = 0; row < h; ++row)
+                memcpy(bitmap->pixels.data() + (size_t) row * w, g->bitmap.buffer + row * g->bitmap.pitch, w);
         }
-        glyphs[key] = glyph;
-
-        return { glyphs.at(key) };
+        return bitmap;
     }
 
-    void append_quad(VertexDataFormat v)
+    // Writes the atlas pages, their packing state and the cached glyphs to a snapshot file
+    bool export_snapshot(const char* path)
     {
-        if (cur_quad == max_quads)
-            commit();
+        snapshot::Contents contents;
+        contents.atlas_w = spec::atlas_texture_w;
+        contents.atlas_h = spec::atlas_texture_h;
 
-        assert(cur_quad < max_quads);
-        memcpy(
-            vertices + cur_quad * spec::vertex_data::triangle_points_n * spec::vertex_data::pos_points_n,
-            v.data,
-            sizeof(VertexDataFormat)
+        for (auto& atlas : atlases)
+        {
+            const auto& free_rects = atlas->bin_packer.free_rects();
+
+            snapshot::Page page {};
+            page.free_rects_start = (uint32_t) contents.free_rects.size();
+            page.free_rects_n     = (uint32_t) free_rects.size();
+            page.used_area        = atlas->bin_packer.used_area();
+            contents.pages.push_back(page);
+            contents.pixels.push_back(atlas->data);
+            contents.free_rects.insert(contents.free_rects.end(), free_rects.begin(), free_rects.end());
+        }
+
+        std::unordered_map<Font::Id, uint32_t> font_indices;
+        for (auto& [id, hash] : font_hashes)
+        {
+            font_indices[id] = (uint32_t) contents.font_hashes.size();
+            contents.font_hashes.push_back(hash);
+        }
+
+        contents.glyphs.reserve(glyphs.size());
+        glyphs.for_each(
+            [&](const GlyphKey& key, const Glyph& glyph, uint64_t)
+            {
+                contents.glyphs.push_back(
+                    { font_indices.at(key.first),
+                      key.second,
+                      glyph.size.x,
+                      glyph.size.y,
+                      glyph.bearing.x,
+                      glyph.bearing.y,
+                      glyph.tex_offset.x,
+                      glyph.tex_offset.y,
+                      glyph.tex_index }
+                );
+            }
         );
-        cur_quad++;
+
+        return snapshot::write(path, contents);
     }
 
-    template <typename VertexDataType>
-    void draw_runs(ShaperRun& shaper_run, Point o, Colour colour)
+    // Replaces the atlases and glyph cache with a snapshot mapped from a file
+    bool load_snapshot(const char* path)
     {
-        set_colour(colour);
+        utlz::MappedFile file;
+        if (!file.init(path))
+            return false;
+
+        return load_snapshot(file.data, file.size);
+    }
+
+    // Replaces the atlases and glyph cache with a snapshot in memory (mapped or embedded). Glyphs
+    // are keyed by the face ids reserved for their font hashes, so fonts created later, lazily or
+    // not, find them. Glyphs of faces never opened are evicted like any other unused glyph.
+    bool load_snapshot(const uint8_t* data, size_t size)
+    {
+        snapshot::View view;
+        if (!snapshot::parse(data, size, view))
+            return false;
+
+        const auto& header = *view.header;
+        if (header.atlas_w != spec::atlas_texture_w || header.atlas_h != spec::atlas_texture_h
+            || header.pages_n > atlases.size())
+            return false;
+
+        commit();
+        glyphs.clear();
+        font_hashes.clear();
+        lru.clear();
+
+        for (size_t i = header.pages_n; i < atlases.size(); ++i)
+            atlases[i]->clear();
+        for (auto& gen : dyn_atlases)
+            gen++;
+        for (auto& version : page_versions)
+            version++;
+
+        // the packers keep the regions in use to free them later
+        std::vector<std::vector<binpack::Rect>> used(header.pages_n);
+        for (uint32_t i = 0; i < header.glyphs_n; ++i)
+        {
+            const auto& entry = view.glyphs[i];
+            if (entry.tex_index >= 0)
+                used[entry.tex_index].push_back({ entry.tex_x, entry.tex_y, entry.size_x, entry.size_y });
+        }
+
+        for (uint32_t i = 0; i < header.pages_n; ++i)
+        {
+            const auto& page = view.pages[i];
+            auto& atlas      = *atlases[i];
+            atlas.load_pixels(view.pixels(page), (uint16_t) page.pixel_rows);
+            atlas.bin_packer.restore(
+                atlas.width,
+                atlas.height,
+                view.free_rects + page.free_rects_start,
+                (int) page.free_rects_n,
+                used[i].data(),
+                (int) used[i].size()
+            );
+        }
+
+        std::vector<Font::Id> face_ids(header.fonts_n);
+        for (uint32_t i = 0; i < header.fonts_n; ++i)
+        {
+            face_ids[i] = face_id_for(view.font_hashes[i]);
+            font_hashes.emplace(face_ids[i], view.font_hashes[i]);
+        }
+
+        for (uint32_t i = 0; i < header.glyphs_n; ++i)
+        {
+            const auto& entry = view.glyphs[i];
+
+            Glyph glyph;
+            glyph.size       = { entry.size_x, entry.size_y };
+            glyph.bearing    = { entry.bearing_x, entry.bearing_y };
+            glyph.tex_offset = { entry.tex_x, entry.tex_y };
+            glyph.uv         = atlas_uv(glyph.tex_offset, glyph.size);
+            glyph.tex_index  = entry.tex_index;
+            if (glyph.tex_index >= 0)
+                glyph.dyn_tex = dyn_atlases[glyph.tex_index];
+
+            glyphs.insert_or_assign({ face_ids[entry.font], entry.glyph_index }, glyph);
+            if (glyph.tex_index >= 0)
+                lru.push_back({ { face_ids[entry.font], entry.glyph_index }, 0, glyph.tex_index });
+        }
+
+        return true;
+    }
+
+    // Resolves the glyphs of the runs having pixels into batches and calls the function with
+    // each, with the scale of its font. A batch is flushed before creating a glyph, as that may
+    // evict the regions of the glyphs in it. With a clip rectangle, the runs and glyphs outside of
+    // it are skipped before any glyph work.
+    template <typename F>
+    void for_each_batch(ShaperRun& shaper_run, Point o, const gfx::Aabb* clip, F&& f)
+    {
+        const Point origin = o;
+        if (clip && !shaper_run.bounds.translated(origin).intersects(*clip))
+        {
+            glyphs_culled += shaper_run.total_glyphs_n;
+            return;
+        }
+
+        kernel::QuadBatch b;
         for (auto& run : shaper_run.items)
         {
-            static std::vector<hb_helpers::GlyphInfo> glyph_infos;
-            glyph_infos.clear();
+            const auto bounds = run.bounds.translated(origin);
+            if (clip && !bounds.intersects(*clip))
+            {
+                glyphs_culled += run.hb_info.size();
+                o = o + run.advance;
+                continue;
+            }
+            // only the glyphs of partially visible items are tested one by one
+            const bool partial = clip && !clip->contains(bounds);
 
-            for (int i = 0; i < run.hb_info.size(); ++i)
+            // the cached glyphs are at the canonical SDF size
+            const float scale = run.font->sdf_scale;
+
+            auto flush = [&]
+            {
+                if (b.n > 0)
+                    f(b, scale);
+                b.n = 0;
+            };
+
+            for (size_t i = 0; i < run.hb_info.size(); ++i)
+            {
                 // Freetype: The advance vector is expressed in 1/64 of pixels, and is truncated
                 // to integer pixels on each iteration.
-                glyph_infos.emplace_back(std::forward<hb_helpers::GlyphInfo>(
-                    { run.hb_info[i].codepoint,
-                      run.positions[i].x_offset / 64,
-                      run.positions[i].y_offset / 64,
-                      run.positions[i].x_advance / 64,
-                      run.positions[i].y_advance / 64 }
-                ));
-
-            for (auto& info : glyph_infos)
+                const auto& pos = run.positions[i];
+                auto advance    = [&]
+                {
+                    o.x += pos.x_advance / 64;
+                    o.y += pos.y_advance / 64;
+                };
+
+                if (partial && !run.glyph_bounds.translated(o).intersects(*clip))
+                {
+                    glyphs_culled++;
+                    advance();
+                    continue;
+                }
+
+                auto g = find_glyph(*run.font, run.hb_info[i].codepoint);
+                if (!g)
+                {
+                    flush();
+                    g = create_glyph(*run.font, run.hb_info[i].codepoint);
+                }
+
+                if (g->size.x > 0 && g->size.y > 0)
+                {
+                    const size_t k = b.n++;
+                    b.pen_x[k]     = o.x;
+                    b.pen_y[k]     = o.y;
+                    b.offset_x[k]  = pos.x_offset;
+                    b.offset_y[k]  = pos.y_offset;
+                    b.bearing_x[k] = (float) g->bearing.x;
+                    b.descent[k]   = (float) (g->size.y - g->bearing.y);
+                    b.w[k]         = (float) g->size.x;
+                    b.h[k]         = (float) g->size.y;
+                    b.u0[k]        = g->uv.x;
+                    b.v0[k]        = g->uv.y;
+                    b.u1[k]        = g->uv.z;
+                    b.v1[k]        = g->uv.w;
+                    b.tex_x[k]     = g->tex_offset.x;
+                    b.tex_y[k]     = g->tex_offset.y;
+                    b.layer[k]     = g->tex_index;
+                    if (b.n == kernel::batch_capacity)
+                        flush();
+                }
+
+                advance();
+            }
+
+            flush();
+        }
+    }
+
+    // Calls the function with the quad of each glyph of the runs having pixels, see for_each_batch
+    template <typename F>
+    void for_each_quad(ShaperRun& shaper_run, Point o, const gfx::Aabb* clip, F&& f)
+    {
+        for_each_batch(
+            shaper_run,
+            o,
+            clip,
+            [&](const kernel::QuadBatch& b, float scale)
+            {
+                for (size_t i = 0; i < b.n; ++i)
+                    f(glyph_quad(b, i, scale));
+            }
+        );
+    }
+
+    static GlyphQuad glyph_quad(const kernel::QuadBatch& b, size_t i, float scale)
+    {
+        return { b.pen_x[i] + (float) (b.offset_x[i] / 64) + b.bearing_x[i] * scale,
+                 b.pen_y[i] + (float) (b.offset_y[i] / 64) - b.descent[i] * scale,
+                 b.w[i] * scale,
+                 b.h[i] * scale,
+                 b.tex_x[i],
+                 b.tex_y[i],
+                 (int) b.w[i],
+                 (int) b.h[i],
+                 b.layer[i] };
+    }
+
+    // end of the quads from begin on the same atlas page
+    static size_t layer_run_end(const kernel::QuadBatch& b, size_t begin)
+    {
+        size_t end = begin + 1;
+        while (end < b.n && b.layer[end] == b.layer[begin])
+            ++end;
+        return end;
+    }
+
+    // Writes the quads of the batch straight into the staging vertices with the SIMD kernel,
+    // split where the atlas page changes as it's a uniform for this format
+    void emit_batch(const kernel::QuadBatch& b, float scale)
+    {
+        assert(active_format == VertexFormatId::Triangles);
+        static_assert(sizeof(VertexDataFormat) == kernel::floats_per_glyph * sizeof(float));
+
+        size_t begin = 0;
+        while (begin < b.n)
+        {
+            const size_t end = layer_run_end(b, begin);
+            set_layer(b.layer[begin]);
+
+            while (begin < end)
             {
-                auto g_opt = cached_glyph(*run.font, info.codepoint);
-                Glyph g    = std::invoke(
-                    [&]
+                if (cur_quad == max_quads)
+                    commit();
+
+                const size_t n = std::min<size_t>(end - begin, max_quads - cur_quad);
+                auto* out      = (float*) (vertices + cur_quad * sizeof(VertexDataFormat));
+                kernel::emit_triangles(b, begin, begin + n, scale, out);
+                cur_quad += n;
+                begin += n;
+            }
+        }
+    }
+
+    template <typename VertexDataType>
+    void draw_runs(ShaperRun& shaper_run, Point o, Colour colour)
+    {
+        use_format<VertexDataType>();
+        set_colour(colour);
+        if constexpr (std::is_same_v<VertexDataType, VertexDataFormat>)
+        {
+            for_each_batch(
+                shaper_run,
+                o,
+                &clip,
+                [&](const kernel::QuadBatch& b, float scale) { emit_batch(b, scale); }
+            );
+        }
+        else
+        {
+            using Layout = VertexLayout<VertexDataType>;
+            for_each_batch(
+                shaper_run,
+                o,
+                &clip,
+                [&](const kernel::QuadBatch& b, float scale)
+                {
+                    // the page is set once per run of quads on it, unless the records carry it
+                    size_t begin = 0;
+                    while (begin < b.n)
                     {
-                        if (!g_opt)
-                            throw std::runtime_error("get glyph error");
-                        else
-                            return g_opt.value();
+                        size_t end = b.n;
+                        if constexpr (!Layout::per_glyph_colour)
+                        {
+                            end = layer_run_end(b, begin);
+                            set_layer(b.layer[begin]);
+                        }
+                        for (; begin < end; ++begin)
+                        {
+                            const auto quad = glyph_quad(b, begin, scale);
+                            if (!Layout::fits(quad))
+                            {
+                                glyphs_culled++;
+                                continue;
+                            }
+                            append_quad(Layout::make(quad, colour));
+                        }
                     }
-                );
-                auto g_w = g.size.x, g_h = g.size.y;
-                if (g_w > 0 && g_h > 0)
-                {
-                    auto* atlas = atlases[g.tex_index].get();
-                    set_tex_id(atlas->texture);
-
-                    float glyph_x = o.x + g.bearing.x + info.x_offset;
-                    float glyph_y = o.y - (g.size.y - g.bearing.y) + info.y_offset;
-                    auto glyph_w  = (float) g.size.x;
-                    auto glyph_h  = (float) g.size.y;
-
-                    float tex_x = g.tex_offset.x / (float) atlas->width;
-                    float tex_y = g.tex_offset.y / (float) atlas->height;
-                    float tex_w = glyph_w / (float) atlas->width;
-                    float tex_h = glyph_h / (float) atlas->height;
-
-                    // update VBO for each glyph
-                    append_quad({ { { glyph_x, glyph_y + glyph_h, tex_x, tex_y },
-                                    { glyph_x, glyph_y, tex_x, tex_y + tex_h },
-                                    { glyph_x + glyph_w, glyph_y, tex_x + tex_w, tex_y + tex_h },
-
-                                    { glyph_x, glyph_y + glyph_h, tex_x, tex_y },
-                                    { glyph_x + glyph_w, glyph_y, tex_x + tex_w, tex_y + tex_h },
-                                    { glyph_x + glyph_w, glyph_y + glyph_h, tex_x + tex_w, tex_y } } });
                 }
+            );
+        }
+    }
 
-                o.x += info.x_advance;
-                o.y += info.y_advance;
-            }
+    // Draws the block at the origin, regenerating its instances first if they're stale
+    void draw_block(TextBlock& block, Point o)
+    {
+        if (!block.run)
+            return;
+
+        if (!block.run->bounds.translated(o).intersects(clip))
+        {
+            blocks_culled++;
+            return;
         }
+
+        use_format<GlyphInstance>();
+        // a page may be cleared to make room while building, which makes the block stale again
+        for (int attempt = 0; attempt < 2 && block.is_stale(page_versions); ++attempt)
+            build_block(block);
+
+        if (block.marked_frame != frame)
+        {
+            for (const auto& key : block.glyph_keys)
+                glyphs.mark_used(key, frame);
+            block.marked_frame = frame;
+        }
+
+        if (block.instances_n == 0)
+            return;
+
+        // keep the drawing order of the pending quads
+        commit();
+
+        auto& gl       = gl_state();
+        auto& pipeline = pipelines[(size_t) VertexFormatId::Instances];
+        gl.bind_vertex_array(block.vao);
+        glUniform2f(pipeline.translation_location, o.x, o.y);
+        VertexLayout<GlyphInstance>::draw(block.instances_n);
+        glUniform2f(pipeline.translation_location, 0.0f, 0.0f);
+        gl.bind_vertex_array(pipeline.vao);
+        gl.count(3);
+        blocks_drawn++;
+    }
+
+    // Regenerates the instances of the block relative to its origin into its own buffer
+    void build_block(TextBlock& block)
+    {
+        block.pages_versions = page_versions;
+        block.pages_used     = 0;
+
+        static std::vector<GlyphInstance> instances;
+        instances.clear();
+        // blocks are built whole, so that they stay valid while moving
+        for_each_quad(
+            *block.run,
+            { 0.0f, 0.0f },
+            nullptr,
+            [&](const GlyphQuad& quad)
+            {
+                block.pages_used |= 1u << quad.layer;
+                instances.push_back(VertexLayout<GlyphInstance>::make(quad, block.colour));
+            }
+        );
+
+        auto& gl = gl_state();
+        gl.bind_array_buffer(block.vbo);
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(GlyphInstance), instances.data(), GL_STATIC_DRAW);
+        gl.bind_array_buffer(vbo);
+        gl.count();
+
+        // building looked the glyphs up in this frame
+        block.glyph_keys.clear();
+        for (const auto& run : block.run->items)
+            for (const auto& info : run.hb_info)
+                block.glyph_keys.push_back({ run.font->face_id, info.codepoint });
+        auto& keys = block.glyph_keys;
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        block.marked_frame = frame;
+
+        block.instances_n = (GLsizei) instances.size();
+        block.stale       = false;
+        blocks_built++;
     }
 
     void print_stats()
@@ -484,6 +1263,20 @@ struct TextRenderer : GlRenderer
         }
         fprintf(stdout, "\n");
         fprintf(stdout, "texture atlas evict: %llu\n", textures_evicted);
+        fprintf(stdout, "glyph evict: %llu\n", glyphs_evicted);
+        fprintf(stdout, "vertex buffer orphans: %llu\n", buffers_orphaned);
+        fprintf(stdout, "text blocks drawn: %llu, built: %llu, culled: %llu\n", blocks_drawn, blocks_built, blocks_culled);
+        fprintf(stdout, "glyphs culled: %llu\n", glyphs_culled);
+        const auto& gl = gl_state();
+        if (gl.frames > 0)
+            fprintf(
+                stdout,
+                "gl calls per frame: %llu issued, %llu redundant filtered (last frame %llu, %llu)\n",
+                gl.total_counters.issued / gl.frames,
+                gl.total_counters.filtered / gl.frames,
+                gl.last_frame_counters.issued,
+                gl.last_frame_counters.filtered
+            );
         fprintf(stdout, "request: %llu\n", textures_required);
         fprintf(stdout, "hit    : %llu (%.2f%%)\n", textures_hit, static_cast<double>(textures_hit) / textures_required * 100);
         fprintf(stdout, "\n");
@@ -493,9 +1286,27 @@ struct TextRenderer : GlRenderer
     Atlases atlases;
     using AtlasGen = std::vector<unsigned int>;
     AtlasGen dyn_atlases;
+    // bumped whenever regions of a page may be overwritten, also by single glyph evictions
+    AtlasGen page_versions;
 
     GlyphCache glyphs;
     Glyph line;
+
+    // glyphs having regions, least recently used first, see evict_lru_glyphs
+    struct Queued
+    {
+        GlyphKey key;
+        uint64_t used; // frame last known to have used it
+        int page;
+    };
+    std::deque<Queued> lru;
+    std::vector<std::vector<binpack::Rect>> evicted; // regions to free together, per page
+
+    GlyphBitmapCache bitmaps;
+    std::thread::id render_thread; // owns the GL context, the only one placing glyphs
+
+    // hashes of the faces having glyphs in the cache, for snapshots
+    std::unordered_map<Font::Id, uint64_t> font_hashes;
 };
 
 } // namespace typesetting
\ No newline at end of file
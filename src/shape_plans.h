@@ -0,0 +1,174 @@
+#pragma once
+
+#include <hb.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "concurrent_cache.h"
+#include "profiling.h"
+
+namespace typesetting
+{
+/**
+ * Compiled harfbuzz shape plans, by face, segment properties and features. hb_shape looks the
+ * plan up in the face on every call and compiles it the first time a script is shaped, which for
+ * Arabic, Devanagari or Thai takes long enough to show in a frame. Plans are created once here,
+ * can be compiled ahead by warm_up, and shaping executes them directly.
+ *
+ * The plans of a face have to be forgotten before the face is destroyed.
+ */
+namespace shape_plans
+{
+constexpr unsigned int max_features = 8; // more are shaped without a cached plan
+
+struct Key
+{
+    hb_face_t* face;
+    hb_direction_t direction;
+    hb_script_t script;
+    hb_language_t language;
+    unsigned int features_n;
+    std::array<hb_feature_t, max_features> features;
+
+    bool operator==(const Key& other) const
+    {
+        if (face != other.face || direction != other.direction || script != other.script
+            || language != other.language || features_n != other.features_n)
+            return false;
+        const auto bytes = features_n * sizeof(hb_feature_t);
+        return std::memcmp(features.data(), other.features.data(), bytes) == 0;
+    }
+};
+
+struct KeyHash
+{
+    size_t operator()(const Key& key) const
+    {
+        // FNV-1a over the fields that tell plans apart
+        uint64_t h   = 14695981039346656037ull;
+        auto combine = [&h](uint64_t v)
+        {
+            h ^= v;
+            h *= 1099511628211ull;
+        };
+        combine((uintptr_t) key.face);
+        combine(key.direction);
+        combine(key.script);
+        combine((uintptr_t) key.language);
+        for (unsigned int i = 0; i < key.features_n; ++i)
+        {
+            const auto& f = key.features[i];
+            combine((uint64_t) f.tag << 32 | f.value);
+            combine((uint64_t) f.start << 32 | f.end);
+        }
+        return (size_t) h;
+    }
+};
+
+// few faces and scripts, a shard or two hold them all
+using Cache = ConcurrentCache<Key, hb_shape_plan_t*, KeyHash, 4>;
+
+inline Cache& cache()
+{
+    static Cache plans;
+    return plans;
+}
+
+// The plan for shaping with the face, created the first time. Null if the key can't be cached.
+inline hb_shape_plan_t* get(
+    hb_face_t* face,
+    const hb_segment_properties_t& props,
+    const hb_feature_t* features,
+    unsigned int features_n
+)
+{
+    if (features_n > max_features)
+        return nullptr;
+
+    Key key {};
+    key.face       = face;
+    key.direction  = props.direction;
+    key.script     = props.script;
+    key.language   = props.language;
+    key.features_n = features_n;
+    std::copy(features, features + features_n, key.features.begin());
+
+    return cache().get_or_create(
+        key,
+        [&]
+        {
+            PROFILE_ZONE("compile_shape_plan");
+            // no variation coordinates, see shape
+            return hb_shape_plan_create_cached2(
+                face,
+                &props,
+                features,
+                features_n,
+                nullptr,
+                0,
+                nullptr
+            );
+        }
+    );
+}
+
+// hb_shape_full through the cached plan of the font and the properties of the buffer
+inline bool shape(
+    hb_font_t* font,
+    hb_buffer_t* buffer,
+    const hb_feature_t* features = nullptr,
+    unsigned int features_n      = 0
+)
+{
+    // plans of variable fonts depend on the coordinates of the instance, these aren't cached
+    unsigned int coords_n = 0;
+    hb_font_get_var_coords_normalized(font, &coords_n);
+
+    hb_segment_properties_t props;
+    hb_buffer_get_segment_properties(buffer, &props);
+    auto* plan = coords_n == 0 ? get(hb_font_get_face(font), props, features, features_n) : nullptr;
+    if (plan && hb_shape_plan_execute(plan, font, buffer, features, features_n))
+        return true;
+    return hb_shape_full(font, buffer, features, features_n, nullptr);
+}
+
+// Compiles the plan the script is shaped with by default, as hb_buffer_guess_segment_properties
+// would set it
+inline void warm_up(
+    hb_font_t* font,
+    hb_script_t script,
+    const hb_feature_t* features = nullptr,
+    unsigned int features_n      = 0
+)
+{
+    hb_segment_properties_t props {};
+    props.direction = hb_script_get_horizontal_direction(script);
+    props.script    = script;
+    props.language  = hb_language_get_default();
+    if (props.direction == HB_DIRECTION_INVALID)
+        props.direction = HB_DIRECTION_LTR;
+    get(hb_font_get_face(font), props, features, features_n);
+}
+
+// Before the face is destroyed, drops its plans
+inline void forget_face(hb_face_t* face)
+{
+    std::vector<hb_shape_plan_t*> plans;
+    cache().erase_if(
+        [&](const Key& key, hb_shape_plan_t* plan, uint64_t)
+        {
+            if (key.face != face)
+                return false;
+            plans.push_back(plan);
+            return true;
+        }
+    );
+    for (auto* plan : plans)
+        hb_shape_plan_destroy(plan);
+}
+} // namespace shape_plans
+} // namespace typesetting
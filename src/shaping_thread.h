@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "text.h"
+#include "profiling.h"
+
+namespace typesetting
+{
+// Single producer, single consumer ring. Neither side locks, the positions hand the slots over.
+template <typename T, uint32_t capacity>
+struct SpscQueue
+{
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+    bool push(T&& item)
+    {
+        const auto head = write_pos.load(std::memory_order_relaxed);
+        if (head - read_pos.load(std::memory_order_acquire) == capacity)
+            return false;
+        items[head & (capacity - 1)] = std::move(item);
+        write_pos.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        const auto tail = read_pos.load(std::memory_order_relaxed);
+        if (tail == write_pos.load(std::memory_order_acquire))
+            return false;
+        item = std::move(items[tail & (capacity - 1)]);
+        read_pos.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        const auto tail = read_pos.load(std::memory_order_acquire);
+        return tail == write_pos.load(std::memory_order_acquire);
+    }
+
+    T items[capacity];
+    alignas(64) std::atomic<uint64_t> write_pos { 0 };
+    alignas(64) std::atomic<uint64_t> read_pos { 0 };
+};
+
+// An edit of the input text, stamped when it was made
+struct EditEvent
+{
+    enum class Kind : uint8_t
+    {
+        Type, // appended to the typed line
+        Paste // a line of its own
+    };
+
+    Kind kind = Kind::Type;
+    std::string text;
+    uint64_t made_ns = 0; // profiling::now_ns()
+};
+
+// Immutable once published. Lines that didn't change are shared with the previous snapshots.
+struct ShapedInput
+{
+    std::vector<std::shared_ptr<ShaperRun>> lines; // the typed line, then the pasted ones
+    uint64_t edits_n        = 0;                   // edits shaped into it
+    uint64_t newest_edit_ns = 0;                   // when the newest of them was made
+};
+
+/**
+ * Shapes the input text off the render thread. The input callbacks push edits into a lock-free
+ * queue, the shaping thread applies all the queued edits, reshapes the lines they changed and
+ * publishes a new snapshot by swapping a pointer, and the render thread takes the newest snapshot
+ * when it starts a frame. A frame draws whatever was published last and never waits for shaping.
+ *
+ * Snapshots the render thread didn't take before a newer one was published are dropped by the
+ * shaping thread. After init(), the fonts of the map must only be created (FontHandle::get) by
+ * the shaping thread.
+ */
+struct ShapingThread
+{
+    static constexpr uint32_t queue_capacity = 1024;
+
+    // on_publish is called on the shaping thread after publishing, e.g. to wake the event loop,
+    // and on_shaped with each line shaped before it's published, e.g. to rasterize its glyphs
+    bool init(
+        Font::Map* font_map,
+        std::vector<std::string> initial_lines,
+        std::function<void()> on_publish                = {},
+        std::function<void(const ShaperRun&)> on_shaped = {}
+    )
+    {
+        fonts     = font_map;
+        lines     = std::move(initial_lines);
+        published = std::move(on_publish);
+        shaped_fn = std::move(on_shaped);
+        if (lines.empty())
+            lines.emplace_back();
+        shaped.resize(lines.size());
+        dirty.assign(lines.size(), true);
+
+        quit.store(false);
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    void destroy()
+    {
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit.store(true);
+        }
+        wake.notify_one();
+        thread.join();
+        delete latest.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    // From the one input thread. Waits only while shaping is queue_capacity edits behind.
+    void push(EditEvent event)
+    {
+        while (!edits.push(std::move(event)))
+            std::this_thread::yield();
+        {
+            // pairs with the wait so that the wake up isn't lost
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        wake.notify_one();
+    }
+
+    // From the render thread, the snapshot published since the last call or null
+    std::unique_ptr<ShapedInput> take()
+    {
+        return std::unique_ptr<ShapedInput>(latest.exchange(nullptr, std::memory_order_acquire));
+    }
+
+private:
+    void run()
+    {
+        profiling::set_thread_name("shaping");
+        uint64_t edits_n = 0, newest_edit_ns = 0;
+        for (;;)
+        {
+            EditEvent event;
+            bool changed = false;
+            while (edits.pop(event))
+            {
+                apply(event);
+                changed        = true;
+                newest_edit_ns = event.made_ns;
+                edits_n++;
+            }
+
+            if (changed || edits_n == 0)
+                publish(edits_n, newest_edit_ns);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return quit.load() || !edits.empty(); });
+            if (quit.load())
+                return;
+        }
+    }
+
+    void apply(EditEvent& event)
+    {
+        if (event.kind == EditEvent::Kind::Type)
+        {
+            lines[0] += event.text;
+            dirty[0] = true;
+        }
+        else
+        {
+            lines.emplace_back(std::move(event.text));
+            shaped.emplace_back();
+            dirty.push_back(true);
+        }
+    }
+
+    void publish(uint64_t edits_n, uint64_t newest_edit_ns)
+    {
+        {
+            PROFILE_ZONE("shape_input");
+            for (size_t i = 0; i < lines.size(); ++i)
+            {
+                if (!dirty[i])
+                    continue;
+                shaped[i] = std::make_shared<ShaperRun>(create_shapers(lines[i], *fonts));
+                dirty[i]  = false;
+                if (shaped_fn)
+                    shaped_fn(*shaped[i]);
+            }
+        }
+
+        auto* snapshot           = new ShapedInput;
+        snapshot->lines          = shaped;
+        snapshot->edits_n        = edits_n;
+        snapshot->newest_edit_ns = newest_edit_ns;
+        // the render thread didn't take the previous one, it's out of date
+        delete latest.exchange(snapshot, std::memory_order_acq_rel);
+
+        if (newest_edit_ns != 0)
+        {
+            PROFILE_SINCE("edit_to_shaped", newest_edit_ns);
+        }
+        if (published)
+            published();
+    }
+
+    SpscQueue<EditEvent, queue_capacity> edits;
+    std::atomic<ShapedInput*> latest { nullptr };
+
+    std::thread thread;
+    std::atomic<bool> quit { false };
+    std::mutex mutex; // only for sleeping while there are no edits
+    std::condition_variable wake;
+    std::function<void()> published;
+    std::function<void(const ShaperRun&)> shaped_fn;
+
+    // owned by the shaping thread once started
+    Font::Map* fonts = nullptr;
+    std::vector<std::string> lines;
+    std::vector<std::shared_ptr<ShaperRun>> shaped;
+    std::vector<bool> dirty;
+};
+} // namespace typesetting
@@ -11,9 +11,24 @@ constexpr int h = 900;
 constexpr int atlas_texture_w = 1024;
 constexpr int atlas_texture_h = 1024;
 
+// pixel size the SDF glyphs are rasterized at for all font sizes
+constexpr int sdf_glyph_size = 48;
+
+// prebaked atlas loaded at startup and written at exit
+constexpr const char* atlas_snapshot_file = "font-front.atlas";
+
+// coverage of the fonts directory written by font_indexer, picks the fallback fonts
+constexpr const char* font_index_file = "font-front.fonts";
+
+// Chrome trace written when tracing is toggled off (Ctrl+T)
+constexpr const char* trace_file = "font-front.trace.json";
+
 namespace vertex_data
 {
 constexpr int triangle_points_n = 6;
 constexpr int pos_points_n      = 4;
+
+// streamed vertex buffer, orphaned when a commit doesn't fit the rest of it
+constexpr long ring_size = 8 * 1024 * 1024;
 } // namespace vertex_data
 } // namespace spec
@@ -2,21 +2,36 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H // Include FreeType header files
+#include FT_SIZES_H
 #include <hb-ft.h>
+#include <hb-ot.h>
 #include <utility>
 #include <thread>
 #include <bitset>
+#include <array>
+#include <limits>
+#include <iterator>
+#include <memory_resource>
+#include <string_view>
 
 extern "C"
 {
 #include <SheenBidi.h>
 };
 
+#include "spec.h"
+#include "arena.h"
 #include "scope_guards.h"
 #include "blueprints.h"
 #include "types.h"
 #include "library.h"
+#include "concurrent_cache.h"
+#include "shape_plans.h"
+#include "atlas_snapshot.h"
+#include "embedded_fonts.h"
+#include "font_index.h"
 #include "utlz.h"
+#include "profiling.h"
 
 /**
  * Typesetting is the composition of text for publication, display, or distribution by means of
@@ -26,6 +41,19 @@ extern "C"
 namespace typesetting
 {
 
+// Where harfbuzz gets the glyphs and their metrics from while shaping
+enum class FontFuncs
+{
+    FreeType, // hb_ft, through the glyph loaders of the FreeType face
+    OpenType  // hb_ot, harfbuzz reads the font tables itself, thread-safe and faster
+};
+
+// bench_shaping compares the two, the metrics of OpenType match those of FreeType
+constexpr FontFuncs default_font_funcs = FontFuncs::OpenType;
+
+struct FontHandle;
+struct IndexedFonts;
+
 struct Font
 {
     using Id          = unsigned int;
@@ -36,7 +64,7 @@ struct Font
     {
         const hb_script_t _fallback_key = HB_SCRIPT_INVALID;
 
-        void add(hb_script_t script, std::vector<Font*> fonts)
+        void add(hb_script_t script, std::vector<FontHandle*> fonts)
         {
             // call once trick
             volatile static int _ = std::invoke(
@@ -55,7 +83,16 @@ struct Font
             _map.emplace(script, m);
         }
 
-        void set_fallback(std::vector<Font*> fonts) { add(_fallback_key, std::move(fonts)); }
+        void set_fallback(std::vector<FontHandle*> fonts) { add(_fallback_key, std::move(fonts)); }
+
+        // fonts of a font index are tried before the fallback fonts, and for unmapped scripts
+        void set_indexed(IndexedFonts* fonts) { indexed = fonts; }
+
+        bool has(const hb_script_t key) const { return _map.find(key) != _map.end(); }
+
+        // creates the first font of each mapped script and compiles the shape plan of the script
+        // for it, so that the first text of a script doesn't compile it mid frame
+        void warm_up_shape_plans();
 
         void print_tag(hb_script_t script) const
         {
@@ -66,7 +103,7 @@ struct Font
         }
 
         // returns the font in the array at key+idx and how many are left in the array
-        std::tuple<int, Font*> at(const hb_script_t key, int idx) const
+        std::tuple<int, FontHandle*> at(const hb_script_t key, int idx) const
         {
             //            std::cout << "[tag: \"";
             //            print_tag(key);
@@ -98,44 +135,186 @@ struct Font
             int length = 0;
         };
 
-        std::vector<Font*> db;
+        std::vector<FontHandle*> db; // fonts are created when itemization first reaches them
         std::unordered_map<hb_script_t, Mapping> _map;
+        IndexedFonts* indexed = nullptr;
     };
 
     Id id;
+    Id face_id;    // shared by the sizes of a face, see claim_face_id
+    uint64_t hash; // identifies the face across runs, see snapshot::font_hash
     Face face;
     UnicodeType unicode;
+    FontFuncs funcs;
     float font_size;
     float content_scale;
+
+    // Glyphs are rasterized once per face at spec::sdf_glyph_size and scaled to the font size
+    FT_Size size;     // size used for shaping
+    FT_Size sdf_size; // size used for rasterizing
+    float sdf_scale;
+
+    std::mutex* face_mutex; // of the shared face, see SharedFace::mutex
 };
 
+// Locks the face while harfbuzz reads it through hb_ft, the OpenType font functions don't use it
+inline std::unique_lock<std::mutex> lock_face_for_shaping(const Font& font)
+{
+    if (font.funcs == FontFuncs::FreeType)
+        return std::unique_lock<std::mutex>(*font.face_mutex);
+    return {};
+}
+
+/**
+ * Tables of a font to lay out printable ASCII without harfbuzz, see ShapingOptions::simple: the
+ * glyphs of its cmap, their advances and extents, and how harfbuzz adjusts the advance of the
+ * first char of each pair with the ligatures off, i.e. the pair kerning.
+ */
+struct SimpleMetrics
+{
+    static constexpr char32_t first = 0x20, last = 0x7e;
+    static constexpr int chars_n    = last - first + 1;
+    // harfbuzz does more to the pair than adjusting the first advance
+    static constexpr hb_position_t not_pairwise = std::numeric_limits<hb_position_t>::min();
+
+    hb_position_t pair(char32_t a, char32_t b) const
+    {
+        return pairs[(a - first) * chars_n + (b - first)];
+    }
+
+    std::array<hb_codepoint_t, chars_n> glyphs {}; // 0 where harfbuzz doesn't map the char alone
+    std::array<hb_position_t, chars_n> advances {};
+    std::array<hb_glyph_extents_t, chars_n> extents {}; // empty without ink
+    std::vector<hb_position_t> pairs;                    // chars_n x chars_n
+};
+
+// By font id and whether kerned, created when a font first shapes simply
+using SimpleMetricsCache =
+    ConcurrentCache<uint64_t, std::shared_ptr<const SimpleMetrics>, std::hash<uint64_t>, 4>;
+
+inline SimpleMetricsCache& simple_metrics_cache()
+{
+    static SimpleMetricsCache cache;
+    return cache;
+}
+
+inline uint64_t simple_metrics_key(Font::Id id, bool kerning)
+{
+    return (uint64_t) id << 1 | kerning;
+}
+
 static unsigned int gen_id()
 {
     static unsigned int id = 0;
     return id++;
 }
 
-std::optional<Font> create_font_bin(
-    Library* resources,
-    const unsigned char* font_bin,
-    const unsigned int bin_size,
-    const int font_size,
-    const float content_scale
-)
+// Face ids by face hash. An id is reserved for a hash before the face is opened, e.g. by glyphs
+// restored from a snapshot, and claimed by the first face opened with that hash.
+struct FaceIds
 {
-    static int next_id = 0;
-    Font font;
+    struct Entry
+    {
+        Font::Id id;
+        bool claimed;
+    };
 
-    if (FT_New_Memory_Face(resources->library, font_bin, FT_Long(bin_size), 0, &font.face))
-        return std::nullopt;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> by_hash;
+    Font::Id next = 0;
+};
 
-    auto face_scope_dtor = scope_guards::on_scope_exit_(
-        [&]
-        {
-            FT_Done_Face(font.face);
-            font.face = nullptr;
-        }
-    );
+static FaceIds& face_ids()
+{
+    static FaceIds ids;
+    return ids;
+}
+
+// The id the face with the hash gets when it's opened
+static Font::Id face_id_for(uint64_t hash)
+{
+    auto& ids = face_ids();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    auto [iter, inserted] = ids.by_hash.try_emplace(hash, FaceIds::Entry { ids.next, false });
+    if (inserted)
+        ids.next++;
+    return iter->second.id;
+}
+
+// Ids are interned by the Library::faces key, the sizes of a face share it. Another face with the
+// same hash gets an id of its own, so that a collision can't mix up the glyphs of two faces.
+static Font::Id claim_face_id(uint64_t hash)
+{
+    auto& ids = face_ids();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    auto [iter, inserted] = ids.by_hash.try_emplace(hash, FaceIds::Entry { ids.next, true });
+    if (inserted)
+    {
+        ids.next++;
+        return iter->second.id;
+    }
+    if (!iter->second.claimed)
+    {
+        iter->second.claimed = true;
+        return iter->second.id;
+    }
+    return ids.next++;
+}
+
+// Opens the face under the key once, later calls return the same one. Sizes share its FreeType
+// face, the SDF size it's rasterized at and the harfbuzz face.
+template <typename OpenFace, typename CreateBlob>
+static SharedFace* intern_face(Library* resources, const std::string& key, OpenFace&& open_face, CreateBlob&& create_blob)
+{
+    if (auto iter = resources->faces.find(key); iter != resources->faces.end())
+        return &iter->second;
+
+    ft_memory::MemoryScope memory_scope(ft_memory::Subsystem::Faces);
+    SharedFace shared;
+    auto face_scope_dtor = scope_guards::on_scope_exit_([&] { Library::destroy_face(shared); });
+    if (!open_face(shared))
+        return nullptr;
+
+    {
+        ft_memory::MemoryScope sizes_scope(ft_memory::Subsystem::Sizes);
+        if (FT_New_Size(shared.face, &shared.sdf_size))
+            return nullptr;
+        FT_Activate_Size(shared.sdf_size);
+        FT_Set_Pixel_Sizes(shared.face, 0, spec::sdf_glyph_size);
+    }
+
+    hb_blob_t* blob = create_blob(shared);
+    shared.tables   = hb_face_create(blob, 0);
+    hb_blob_destroy(blob);
+    if (hb_face_get_glyph_count(shared.tables) == 0)
+        return nullptr;
+    // in font units, the sizes scale it
+    shared.parent = hb_font_create(shared.tables);
+    hb_ot_font_set_funcs(shared.parent);
+
+    shared.hash    = snapshot::font_hash(shared.face);
+    shared.face_id = claim_face_id(shared.hash);
+
+    face_scope_dtor.dismiss();
+    return &resources->faces.emplace(key, std::move(shared)).first->second;
+}
+
+// Creates a font of the size on a shared face, a few KB for the FreeType size and the harfbuzz font
+static std::optional<Font>
+create_sized_font(SharedFace& shared, const int font_size, const float content_scale, const FontFuncs funcs)
+{
+    Font font;
+    font.face       = shared.face;
+    font.sdf_size   = shared.sdf_size;
+    font.face_mutex = shared.mutex.get();
+    // the renderer may be rasterizing from the face
+    std::lock_guard<std::mutex> face_lock(*font.face_mutex);
+    {
+        ft_memory::MemoryScope memory_scope(ft_memory::Subsystem::Sizes);
+        if (FT_New_Size(font.face, &font.size))
+            return std::nullopt;
+    }
+    FT_Activate_Size(font.size);
 
 #if defined(_WIN32)
     const int logic_dpi_x = 96;
@@ -154,83 +333,344 @@ std::optional<Font> create_font_bin(
         logic_dpi_x,                                  // horizontal device resolution
         logic_dpi_y                                   // vertical device resolution
     );
+    font.sdf_scale = font_size * content_scale * logic_dpi_y / 72.f / (float) spec::sdf_glyph_size;
 
-    font.unicode = hb_ft_font_create_referenced(font.face);
-    hb_ft_font_set_funcs(font.unicode);
-
-    face_scope_dtor.dismiss();
+    font.funcs = funcs;
+    if (funcs == FontFuncs::FreeType)
+    {
+        // hb_ft loads glyphs at the active size of the face, see create_shapers
+        font.unicode = hb_ft_font_create_referenced(font.face);
+        hb_ft_font_set_funcs(font.unicode);
+    }
+    else
+    {
+        font.unicode = hb_font_create_sub_font(shared.parent);
+
+        // same scale as hb_ft, positions come out in 26.6 pixels either way
+        const auto& metrics = font.size->metrics;
+        const auto upem     = (uint64_t) font.face->units_per_EM;
+        hb_font_set_scale(
+            font.unicode,
+            (int) (((uint64_t) metrics.x_scale * upem + (1u << 15)) >> 16),
+            (int) (((uint64_t) metrics.y_scale * upem + (1u << 15)) >> 16)
+        );
+        hb_font_set_ppem(font.unicode, metrics.x_ppem, metrics.y_ppem);
+    }
 
     font.id            = gen_id();
+    font.hash          = shared.hash;
+    font.face_id       = shared.face_id;
     font.font_size     = font_size;
     font.content_scale = content_scale;
+    shared.sizes_n++;
     // TODO: bold and italics..
     return { font };
 }
 
-// Set font_size and content_scale before calling
-std::optional<Font>
-create_font(Library* resources, const char* font_file, const int font_size, const float content_scale)
+std::optional<Font> create_font_bin(
+    Library* resources,
+    const unsigned char* font_bin,
+    const unsigned int bin_size,
+    const int font_size,
+    const float content_scale,
+    const FontFuncs funcs = default_font_funcs
+)
 {
-    static int next_id = 0;
-    Font font;
-
-    if (FT_New_Face(resources->library, font_file, 0, &font.face))
+    // the same blob is the same face
+    char key[48];
+    snprintf(key, sizeof(key), "bin:%p:%u", (const void*) font_bin, bin_size);
+
+    auto* shared = intern_face(
+        resources,
+        key,
+        [&](SharedFace& shared)
+        { return !FT_New_Memory_Face(resources->library, font_bin, FT_Long(bin_size), 0, &shared.face); },
+        [&](const SharedFace&)
+        { return hb_blob_create((const char*) font_bin, bin_size, HB_MEMORY_MODE_READONLY, nullptr, nullptr); }
+    );
+    if (!shared)
         return std::nullopt;
 
-    auto face_scope_dtor = scope_guards::on_scope_exit_(
-        [&]
+    return create_sized_font(*shared, font_size, content_scale, funcs);
+}
+
+// A font compressed into the binary, decompressed when its face is first created
+std::optional<Font> create_font_embedded(
+    Library* resources,
+    const char* name,
+    const int font_size,
+    const float content_scale,
+    const FontFuncs funcs = default_font_funcs
+)
+{
+    auto* shared = intern_face(
+        resources,
+        std::string("embedded:") + name,
+        [&](SharedFace& shared)
+        {
+            const auto* entry = embedded_fonts::find(name);
+            return entry && embedded_fonts::decompress(*entry, &resources->allocator.memory, shared.data)
+                && !FT_New_Memory_Face(resources->library, shared.data.data(), FT_Long(shared.data.size()), 0, &shared.face);
+        },
+        [&](const SharedFace& shared)
         {
-            FT_Done_Face(font.face);
-            font.face = nullptr;
+            return hb_blob_create(
+                (const char*) shared.data.data(),
+                (unsigned int) shared.data.size(),
+                HB_MEMORY_MODE_READONLY,
+                nullptr,
+                nullptr
+            );
         }
     );
+    if (!shared)
+        return std::nullopt;
 
-#if defined(_WIN32)
-    const int logic_dpi_x = 96;
-    const int logic_dpi_y = 96;
-#elif defined(__APPLE__)
-    const int logic_dpi_x = 72;
-    const int logic_dpi_y = 72;
-#else
-    #error "not implemented"
-#endif
+    return create_sized_font(*shared, font_size, content_scale, funcs);
+}
 
-    FT_Set_Char_Size(
-        font.face,
-        0,                                            // same as character height
-        utlz::to_ft_float(font_size * content_scale), // char_height in 1/64th of points
-        logic_dpi_x,                                  // horizontal device resolution
-        logic_dpi_y                                   // vertical device resolution
+// The file is mapped rather than read, its pages are loaded as FreeType and harfbuzz touch them
+std::optional<Font> create_font(
+    Library* resources,
+    const char* font_file,
+    const int font_size,
+    const float content_scale,
+    const FontFuncs funcs = default_font_funcs
+)
+{
+    auto* shared = intern_face(
+        resources,
+        font_file,
+        [&](SharedFace& shared)
+        {
+            shared.file = std::make_unique<utlz::MappedFile>();
+            return shared.file->init(font_file)
+                && !FT_New_Memory_Face(resources->library, shared.file->data, FT_Long(shared.file->size), 0, &shared.face);
+        },
+        [&](const SharedFace& shared)
+        {
+            return hb_blob_create(
+                (const char*) shared.file->data,
+                (unsigned int) shared.file->size,
+                HB_MEMORY_MODE_READONLY,
+                nullptr,
+                nullptr
+            );
+        }
     );
+    if (!shared)
+        return std::nullopt;
 
-    font.unicode = hb_ft_font_create_referenced(font.face);
-    hb_ft_font_set_funcs(font.unicode);
-
-    face_scope_dtor.dismiss();
-
-    font.id            = gen_id();
-    font.font_size     = font_size;
-    font.content_scale = content_scale;
-    // TODO: bold and italics..
-    return { font };
+    return create_sized_font(*shared, font_size, content_scale, funcs);
 }
 
+// Releases the size, the face stays with the library for other sizes
 void destroy_font(Font& font)
 {
     if (font.unicode)
     {
+        // hb_ft made a face for the font, the OpenType fonts share the one of the SharedFace
+        if (font.funcs == FontFuncs::FreeType)
+            shape_plans::forget_face(hb_font_get_face(font.unicode));
+        simple_metrics_cache().erase(simple_metrics_key(font.id, false));
+        simple_metrics_cache().erase(simple_metrics_key(font.id, true));
         hb_font_destroy(font.unicode);
         font.unicode = nullptr;
     }
 
-    if (font.face)
+    if (font.size)
+    {
+        std::lock_guard<std::mutex> face_lock(*font.face_mutex);
+        FT_Done_Size(font.size);
+        font.size = nullptr;
+    }
+    font.face = nullptr;
+}
+
+/**
+ * A font registered by its source and size, created the first time get() is called. Itemization
+ * only gets the fonts of a fallback chain it reaches, so fonts most texts don't need are never
+ * parsed.
+ */
+struct FontHandle
+{
+    FontHandle() = default;
+
+    // a font file, mapped when the font is created
+    static FontHandle file(
+        Library* resources,
+        std::string path,
+        int font_size,
+        float content_scale,
+        FontFuncs funcs = default_font_funcs
+    )
+    {
+        FontHandle handle;
+        handle.resources     = resources;
+        handle.path          = std::move(path);
+        handle.font_size     = font_size;
+        handle.content_scale = content_scale;
+        handle.funcs         = funcs;
+        return handle;
+    }
+
+    // a font compressed into the binary by cmake/embed_fonts.cmake, by its file name
+    static FontHandle embedded(
+        Library* resources,
+        std::string name,
+        int font_size,
+        float content_scale,
+        FontFuncs funcs = default_font_funcs
+    )
+    {
+        auto handle        = file(resources, std::move(name), font_size, content_scale, funcs);
+        handle.is_embedded = true;
+        return handle;
+    }
+
+    // a font in memory that outlives it
+    static FontHandle
+    bin(Library* resources, const unsigned char* font_bin, unsigned int bin_size, int font_size, float content_scale)
+    {
+        FontHandle handle;
+        handle.resources     = resources;
+        handle.font_bin      = font_bin;
+        handle.bin_size      = bin_size;
+        handle.font_size     = font_size;
+        handle.content_scale = content_scale;
+        return handle;
+    }
+
+    // the font, or null if creating it failed
+    Font* get()
+    {
+        if (font || failed)
+            return font.get();
+
+        auto created = font_bin    ? create_font_bin(resources, font_bin, bin_size, font_size, content_scale, funcs)
+                     : is_embedded ? create_font_embedded(resources, path.c_str(), font_size, content_scale, funcs)
+                                   : create_font(resources, path.c_str(), font_size, content_scale, funcs);
+        if (!created)
+        {
+            fprintf(stderr, "creating font %s failed\n", font_bin ? "from memory" : path.c_str());
+            failed = true;
+            return nullptr;
+        }
+        font = std::make_unique<Font>(*created);
+        return font.get();
+    }
+
+    bool is_created() const { return font != nullptr; }
+
+    void destroy()
+    {
+        if (font)
+            destroy_font(*font);
+        font.reset();
+    }
+
+    Library* resources = nullptr;
+    std::string path; // or the name of an embedded font
+    bool is_embedded = false;
+    const unsigned char* font_bin = nullptr;
+    unsigned int bin_size         = 0;
+    int font_size                 = 0;
+    float content_scale           = 1.0f;
+    FontFuncs funcs               = default_font_funcs;
+
+    // heap allocated to keep its address for the runs shaped with it
+    std::unique_ptr<Font> font;
+    bool failed = false;
+};
+
+inline void Font::Map::warm_up_shape_plans()
+{
+    PROFILE_ZONE("warm_up_shape_plans");
+    for (const auto& [script, m] : _map)
     {
-        // TODO: not necessary when using hb_create_font_referenced
-        FT_Done_Face(font.face);
-        font.face = nullptr;
+        if (script == _fallback_key || m.length == 0)
+            continue;
+        Font* font = db[m.start] ? db[m.start]->get() : nullptr;
+        if (!font)
+            continue;
+        auto face_lock = lock_face_for_shaping(*font);
+        shape_plans::warm_up(font->unicode, script);
     }
 }
 
+/**
+ * Fallback fonts of a directory indexed offline by font_indexer. Each indexed font has a handle,
+ * and the index says which of them to create for a script or a codepoint, so fonts that aren't
+ * picked are never opened.
+ */
+struct IndexedFonts
+{
+    bool init(
+        Library* resources,
+        const char* index_path,
+        const std::string& font_dir,
+        int font_size,
+        float content_scale,
+        FontFuncs funcs = default_font_funcs
+    )
+    {
+        if (!index.init(index_path))
+            return false;
+        handles.reserve(index.fonts_n());
+        for (uint32_t i = 0; i < index.fonts_n(); ++i)
+        {
+            const auto path = font_dir + "/" + index.font_name(i);
+            handles.emplace_back(FontHandle::file(resources, path, font_size, content_scale, funcs));
+        }
+        return true;
+    }
+
+    void destroy()
+    {
+        for (auto& handle : handles)
+            handle.destroy();
+        handles.clear();
+        index.destroy();
+    }
+
+    FontHandle* for_script(hb_script_t script)
+    {
+        const int font = index.font_for_script(script);
+        return font >= 0 ? &handles[font] : nullptr;
+    }
+
+    FontHandle* for_codepoint(char32_t codepoint)
+    {
+        const int font = index.font_for_codepoint(codepoint);
+        return font >= 0 ? &handles[font] : nullptr;
+    }
+
+    // the fonts for the unresolved codepoints of a segment, the best of its script first
+    template <typename Resolved, typename Fonts>
+    void collect(
+        hb_script_t script,
+        std::u32string_view str,
+        size_t start,
+        size_t end,
+        const Resolved& resolved,
+        Fonts& fonts
+    )
+    {
+        auto push = [&fonts](FontHandle* handle)
+        {
+            if (handle && std::find(fonts.begin(), fonts.end(), handle) == fonts.end())
+                fonts.push_back(handle);
+        };
+        push(for_script(script));
+        for (size_t i = start; i < end; ++i)
+            if (!resolved[i])
+                push(for_codepoint(str[i]));
+    }
+
+    font_index::Index index;
+    std::vector<FontHandle> handles;
+};
+
 // Declarations of Text
 using namespace gfx;
 
@@ -262,15 +702,25 @@ struct GlyphInfo
 
 struct RunItem
 {
-    std::vector<hb_glyph_info_t> hb_info;
-    std::vector<hb_glyph_position_t> positions;
+    std::pmr::vector<hb_glyph_info_t> hb_info;
+    std::pmr::vector<hb_glyph_position_t> positions;
     Font* font;
+
+    // in pixels with y up, for culling
+    gfx::Aabb bounds;       // ink of the item relative to the origin of the shaper run
+    gfx::Aabb glyph_bounds; // union of the glyph inks relative to their pen positions
+    Point advance { 0, 0 }; // pen movement over the item
 };
 
 struct ShaperRun
 {
+    ShaperRun() = default;
+    // the items and their glyphs are allocated from the resource
+    explicit ShaperRun(std::pmr::memory_resource* resource) : items(resource) {}
+
     int total_glyphs_n = 0;
-    std::vector<RunItem> items;
+    std::pmr::vector<RunItem> items;
+    gfx::Aabb bounds; // ink of the whole line relative to its origin
 };
 
 struct FontRun
@@ -280,6 +730,152 @@ struct FontRun
     hb_buffer_t* buffer;
 };
 
+/**
+ * What a create_shapers call needs only while it runs: the utf32 text, the font runs and the
+ * harfbuzz buffers. Each thread has one, rewound by every call, so once it has grown to the
+ * longest text shaping no longer allocates on the heap for it.
+ */
+struct ShapingScratch
+{
+    ShapingScratch() = default;
+    ShapingScratch(const ShapingScratch&) = delete;
+    ShapingScratch& operator=(const ShapingScratch&) = delete;
+
+    ~ShapingScratch()
+    {
+        for (auto* buffer : buffers)
+            hb_buffer_destroy(buffer);
+    }
+
+    static ShapingScratch& of_thread()
+    {
+        thread_local ShapingScratch scratch;
+        return scratch;
+    }
+
+    // everything handed out so far is free again
+    void reset()
+    {
+        arena.reset();
+        buffers_used = 0;
+    }
+
+    // an empty buffer as if just created, it keeps the storage of its previous uses
+    hb_buffer_t* buffer()
+    {
+        if (buffers_used == buffers.size())
+            buffers.push_back(hb_buffer_create());
+        auto* buffer = buffers[buffers_used++];
+        hb_buffer_reset(buffer);
+        return buffer;
+    }
+
+    Arena arena;
+    std::vector<hb_buffer_t*> buffers;
+    size_t buffers_used = 0;
+};
+
+// What create_shapers_in does with the text, full OpenType shaping by default
+struct ShapingOptions
+{
+    bool ligatures = true; // the liga and clig features
+    bool kerning   = true; // the kern feature
+
+    // Printable ASCII with a Latin letter, like most UI labels, is laid out with the tables of the
+    // first Latin font without itemizing it and without harfbuzz, the same as full shaping with
+    // the ligatures off. Other text is shaped fully, with the ligatures off.
+    bool simple = false;
+};
+
+// The toggles of the options for harfbuzz, returns how many were written
+inline unsigned int shaping_features(const ShapingOptions& options, hb_feature_t (&features)[3])
+{
+    unsigned int features_n = 0;
+    if (!options.ligatures || options.simple)
+    {
+        features[features_n++] = hb_helpers::Feature::LigatureOff;
+        features[features_n++] = hb_helpers::Feature::CligOff;
+    }
+    if (!options.kerning)
+        features[features_n++] = hb_helpers::Feature::KerningOff;
+    return features_n;
+}
+
+// Shapes each char and each pair of chars of SimpleMetrics with harfbuzz, a few ms once per font
+inline std::shared_ptr<const SimpleMetrics> create_simple_metrics(Font& font, bool kerning)
+{
+    PROFILE_ZONE("create_simple_metrics");
+    using M = SimpleMetrics;
+    ShapingOptions options;
+    options.simple  = true;
+    options.kerning = kerning;
+    hb_feature_t features[3];
+    const auto features_n = shaping_features(options, features);
+
+    auto face_lock = lock_face_for_shaping(font);
+    if (font.funcs == FontFuncs::FreeType)
+        FT_Activate_Size(font.size);
+
+    auto metrics = std::make_shared<M>();
+    auto buffer  = hb_buffer_create();
+    auto shape   = [&](std::initializer_list<uint32_t> chars)
+    {
+        hb_buffer_reset(buffer);
+        hb_buffer_add_utf32(buffer, chars.begin(), (int) chars.size(), 0, (int) chars.size());
+        // as in Latin text, punctuation alone would be guessed to be common
+        hb_buffer_set_script(buffer, HB_SCRIPT_LATIN);
+        hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+        hb_buffer_guess_segment_properties(buffer);
+        shape_plans::shape(font.unicode, buffer, features, features_n);
+        return hb_buffer_get_length(buffer);
+    };
+    auto unpositioned = [](const hb_glyph_position_t& pos)
+    { return pos.x_offset == 0 && pos.y_offset == 0 && pos.y_advance == 0; };
+
+    for (char32_t c = M::first; c <= M::last; ++c)
+    {
+        hb_codepoint_t glyph = 0;
+        if (!hb_font_get_nominal_glyph(font.unicode, c, &glyph) || shape({ c }) != 1)
+            continue;
+        const auto& info = hb_buffer_get_glyph_infos(buffer, nullptr)[0];
+        const auto& pos  = hb_buffer_get_glyph_positions(buffer, nullptr)[0];
+        const auto i     = c - M::first;
+        if (info.codepoint != glyph || !unpositioned(pos)
+            || pos.x_advance != hb_font_get_glyph_h_advance(font.unicode, glyph))
+            continue;
+
+        metrics->glyphs[i]   = glyph;
+        metrics->advances[i] = pos.x_advance;
+        hb_glyph_extents_t extents;
+        if (hb_font_get_glyph_extents(font.unicode, glyph, &extents) && extents.width != 0
+            && extents.height != 0)
+            metrics->extents[i] = extents;
+    }
+
+    metrics->pairs.assign(M::chars_n * M::chars_n, M::not_pairwise);
+    for (char32_t a = M::first; a <= M::last; ++a)
+    {
+        for (char32_t b = M::first; b <= M::last; ++b)
+        {
+            const auto ia = a - M::first, ib = b - M::first;
+            if (metrics->glyphs[ia] == 0 || metrics->glyphs[ib] == 0 || shape({ a, b }) != 2)
+                continue;
+            const auto* infos = hb_buffer_get_glyph_infos(buffer, nullptr);
+            const auto* pos   = hb_buffer_get_glyph_positions(buffer, nullptr);
+            const bool same_glyphs = infos[0].codepoint == metrics->glyphs[ia]
+                                     && infos[1].codepoint == metrics->glyphs[ib];
+            if (same_glyphs && unpositioned(pos[0]) && unpositioned(pos[1])
+                && pos[1].x_advance == metrics->advances[ib])
+                metrics->pairs[ia * M::chars_n + ib] = pos[0].x_advance - metrics->advances[ia];
+        }
+    }
+    hb_buffer_destroy(buffer);
+    return metrics;
+}
+
+// Codepoints of a text itemized into font runs, the rest is cut off
+constexpr int max_shaped_length = 1024;
+
 /**
  * 1.collect individual utf32 codepoints into "font runs" with a matching font (e.g. latin vs.
  * emojis). "Run" refers to a continuous piece of text with similar properties.
@@ -292,16 +888,22 @@ struct FontRun
  *
  * In other words: Paragraphs > Lines > Direction > Script > Font
  */
-std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
+std::pmr::vector<FontRun> create_font_runs(
+    std::string& utf8txt,
+    Font::Map& fonts,
+    ShapingScratch& scratch
+)
 {
-    auto u32_str              = utlz::utf8to32(utf8txt);
+    PROFILE_ZONE("create_font_runs");
+    // at most a codepoint per byte, reserved so that it doesn't regrow in the arena
+    std::pmr::u32string u32_str(&scratch.arena);
+    u32_str.reserve(utf8txt.size());
+    utlz::utf8to32(utf8txt.begin(), utf8txt.end(), std::back_inserter(u32_str));
 
     // truncate to bit mask length
-    constexpr int mask_length = 1024;
+    constexpr int mask_length = max_shaped_length;
     if (u32_str.length() > mask_length)
-        u32_str = u32_str.substr(0, mask_length);
-
-    std::cout << "[" << std::setw(4) << std::to_string(u32_str.length()) << "]";
+        u32_str.resize(mask_length);
 
     SBCodepointSequence sb_str { SBStringEncodingUTF32, (void*) u32_str.c_str(), u32_str.length() };
     SBAlgorithmRef bidi           = SBAlgorithmCreate(&sb_str);
@@ -334,11 +936,12 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
     if (!script_info)
         return {};
 
-    std::vector<FontRun> font_runs;
+    std::pmr::vector<FontRun> font_runs(&scratch.arena);
     font_runs.reserve(max_length / 2); // by2 is an estimate
 
-    auto buffer = hb_buffer_create();
+    auto buffer = scratch.buffer();
     unsigned int run_start, run_end;
+    std::pmr::vector<FontHandle*> indexed_fonts(&scratch.arena);
     int dir_run_idx = 0;
     while (dir_run_idx < max_length && SBScriptLocatorMoveNext(script_loc))
     {
@@ -348,7 +951,7 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
 
         hb_buffer_reset(buffer);
         {
-            STOPWATCH("buffer add txt");
+            PROFILE_ZONE("buffer_add_text");
             hb_buffer_add_utf32(
                 buffer,
                 (const uint32_t*) u32_str.c_str(),
@@ -358,7 +961,7 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
             );
         }
         {
-            STOPWATCH("guess prop");
+            PROFILE_ZONE("guess_props");
             hb_buffer_guess_segment_properties(buffer);
         }
         auto font_key = hb_buffer_get_script(buffer);
@@ -366,19 +969,20 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
         const auto script_start = script_info->offset;
         const auto script_end   = script_start + script_info->length;
 
-        int font_idx = 0;
-        //        auto [fonts_remaining, font_ptr] = fonts.at(font_key, font_idx++);
-        bool script_segment_resolved = false;
-        bool fallback_tried          = false;
-
-        int fonts_remaining;
-        Font* font_ptr;
-    collect_runs:
-        do
+        // collects the runs of the codepoints left that the font has, true once all are resolved
+        auto resolve_with = [&](FontHandle* handle)
         {
-            auto [remaining, fp] = fonts.at(font_key, font_idx++);
-            fonts_remaining      = remaining;
-            font_ptr             = fp;
+            Font* font_ptr = handle ? handle->get() : nullptr;
+            if (!font_ptr)
+                return false;
+
+            // the cmap lookups go through the font functions
+            auto face_lock = lock_face_for_shaping(*font_ptr);
+            auto has_char  = [font_ptr](char32_t c)
+            {
+                hb_codepoint_t glyph;
+                return hb_font_get_nominal_glyph(font_ptr->unicode, c, &glyph) != 0;
+            };
 
             // search for starting point that is left unresolved
             run_start = script_info->offset;
@@ -391,7 +995,7 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
             while (run_end < script_end)
             {
                 // skip until there's a character match with the font
-                if (!utlz::is_char_supported(font_ptr->face, u32_str[run_end]))
+                if (!has_char(u32_str[run_end]))
                 {
                     ++run_start;
                     ++run_end;
@@ -399,14 +1003,14 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
                 }
 
                 // iterate end idx until there's no match while marking these chars as resolved
-                while (run_end < script_end && utlz::is_char_supported(font_ptr->face, u32_str[run_end]))
+                while (run_end < script_end && has_char(u32_str[run_end]))
                 {
                     resolved.set(run_end);
                     ++run_end;
                 }
 
                 // collect the substr as a new buffer
-                auto run_buffer = hb_buffer_create_similar(buffer);
+                auto run_buffer = scratch.buffer();
                 hb_buffer_add_utf32(run_buffer, (uint32_t*) u32_str.c_str(), -1, run_start, (run_end - run_start));
                 {
                     hb_segment_properties_t prop;
@@ -420,23 +1024,38 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
             }
 
             // Check if all codepoints have been handled
-            script_segment_resolved = true;
+            bool script_segment_resolved = true;
             for (SBUInteger i = script_start; i < script_end; ++i)
                 script_segment_resolved &= resolved[i];
+            return script_segment_resolved;
+        };
 
-        } while (fonts_remaining > 0 && !script_segment_resolved);
+        // tries the fonts of the key in order
+        auto resolve_with_fonts = [&](hb_script_t key)
+        {
+            for (int font_idx = 0;; ++font_idx)
+            {
+                auto [fonts_remaining, handle] = fonts.at(key, font_idx);
+                if (resolve_with(handle))
+                    return true;
+                if (fonts_remaining == 0)
+                    return false;
+            }
+        };
 
-        if (!script_segment_resolved && !fallback_tried)
+        // the fonts mapped to the script, then the indexed fonts the index picks for what's left,
+        // then the fallback fonts
+        bool script_segment_resolved = fonts.has(font_key) && resolve_with_fonts(font_key);
+        if (!script_segment_resolved && fonts.indexed)
         {
-            font_key             = fonts._fallback_key;
-            font_idx             = 0;
-            fallback_tried       = true;
-            auto [remaining, fp] = fonts.at(font_key, font_idx++);
-            fonts_remaining      = remaining;
-            font_ptr             = fp;
-
-            goto collect_runs;
+            indexed_fonts.clear();
+            fonts.indexed->collect(font_key, u32_str, script_start, script_end, resolved, indexed_fonts);
+            for (auto* handle : indexed_fonts)
+                if ((script_segment_resolved = resolve_with(handle)))
+                    break;
         }
+        if (!script_segment_resolved)
+            resolve_with_fonts(fonts._fallback_key);
     }
     std::sort(
         font_runs.begin(),
@@ -444,8 +1063,6 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
         [](auto& lhs, auto& rhs) { return lhs.offset < rhs.offset; }
     );
 
-    hb_buffer_destroy(buffer);
-
     SBScriptLocatorRelease(script_loc);
     SBLineRelease(line);
     SBParagraphRelease(paragraph);
@@ -454,31 +1071,152 @@ std::vector<FontRun> create_font_runs(std::string& utf8txt, Font::Map& fonts)
     return font_runs;
 }
 
-ShaperRun create_shapers(std::string& utf8txt, Font::Map& fonts)
+/**
+ * 2. shape the font runs into run items. The shaped run is allocated from out, text shaped anew
+ * every frame can pass an arena rewound every frame. The temporaries come from the ShapingScratch
+ * of the thread.
+ */
+// Bounds and advance of a shaped item, extents_of(i, extents) gives the ink of its ith glyph
+template <typename ExtentsOf>
+void place_item(RunItem& item, Point& pen_end, ExtentsOf&& extents_of)
 {
-    int total_glyphs_n = 0;
-    auto font_runs     = create_font_runs(utf8txt, fonts);
-    // 2. shape from font runs into run items
-    ShaperRun shaper_run;
+    // the pen moves in whole pixels like when drawing, the SDF glyphs are scaled to the shaping
+    // size so the extents at it bound them
+    Point pen = pen_end;
+    for (size_t i = 0; i < item.positions.size(); ++i)
+    {
+        const auto& pos = item.positions[i];
+        hb_glyph_extents_t extents;
+        if (extents_of(i, extents) && extents.width != 0 && extents.height != 0)
+        {
+            const float x0 = (extents.x_bearing + pos.x_offset) / 64.f;
+            const float y1 = (extents.y_bearing + pos.y_offset) / 64.f;
+            const gfx::Aabb ink { { x0, y1 + extents.height / 64.f }, { x0 + extents.width / 64.f, y1 } };
+            item.glyph_bounds.expand(ink);
+            item.bounds.expand(ink.translated(pen));
+        }
+        pen.x += pos.x_advance / 64;
+        pen.y += pos.y_advance / 64;
+    }
+    item.advance = pen - pen_end;
+    pen_end      = pen;
+}
+
+// Lays out printable ASCII from the tables of the font, false if the text needs full shaping: with
+// no Latin letter harfbuzz guesses no script and itemizing takes the fallback fonts, e.g. for
+// digits, and longer text is cut off by create_font_runs
+bool shape_simple(
+    const std::string& utf8txt,
+    Font& font,
+    const SimpleMetrics& metrics,
+    ShaperRun& shaper_run
+)
+{
+    PROFILE_ZONE("shape_simple");
+    using M = SimpleMetrics;
+    if (utf8txt.size() > max_shaped_length)
+        return false;
+    bool has_letter = false;
+    for (size_t i = 0; i < utf8txt.size(); ++i)
+    {
+        const auto c = (unsigned char) utf8txt[i];
+        if (c < M::first || c > M::last || metrics.glyphs[c - M::first] == 0)
+            return false;
+        if (i > 0 && metrics.pair((unsigned char) utf8txt[i - 1], c) == M::not_pairwise)
+            return false;
+        has_letter = has_letter || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+    }
+    if (!has_letter)
+        return false;
+
+    // a run item like harfbuzz makes of it, a glyph per char
+    auto* out = shaper_run.items.get_allocator().resource();
+    std::pmr::vector<hb_glyph_info_t> infos(utf8txt.size(), hb_glyph_info_t {}, out);
+    std::pmr::vector<hb_glyph_position_t> positions(utf8txt.size(), hb_glyph_position_t {}, out);
+    for (size_t i = 0; i < utf8txt.size(); ++i)
+    {
+        const auto c       = (unsigned char) utf8txt[i];
+        infos[i].codepoint = metrics.glyphs[c - M::first];
+        infos[i].cluster   = (uint32_t) i;
+        // harfbuzz adjusts the first advance of a kerned pair
+        positions[i].x_advance = metrics.advances[c - M::first];
+        if (i + 1 < utf8txt.size())
+            positions[i].x_advance += metrics.pair(c, (unsigned char) utf8txt[i + 1]);
+    }
+    auto& item = shaper_run.items.emplace_back(
+        RunItem { std::move(infos), std::move(positions), &font }
+    );
+
+    Point pen_end { 0, 0 };
+    place_item(
+        item,
+        pen_end,
+        [&](size_t i, hb_glyph_extents_t& extents)
+        {
+            extents = metrics.extents[(unsigned char) utf8txt[i] - M::first];
+            return true;
+        }
+    );
+    shaper_run.total_glyphs_n = (int) utf8txt.size();
+    shaper_run.bounds.expand(item.bounds);
+    return true;
+}
+
+ShaperRun create_shapers_in(
+    std::string& utf8txt,
+    Font::Map& fonts,
+    std::pmr::memory_resource* out,
+    const ShapingOptions& options = {}
+)
+{
+    // FreeType allocates for the metrics harfbuzz asks for
+    ft_memory::MemoryScope memory_scope(ft_memory::Subsystem::Shaping);
+    // at() would give the fallback font when Latin isn't mapped, that one is shaped fully
+    if (options.simple && fonts.has(HB_SCRIPT_LATIN))
+    {
+        auto [_, handle] = fonts.at(HB_SCRIPT_LATIN, 0);
+        if (Font* font = handle ? handle->get() : nullptr)
+        {
+            const auto metrics = simple_metrics_cache().get_or_create(
+                simple_metrics_key(font->id, options.kerning),
+                [&] { return create_simple_metrics(*font, options.kerning); }
+            );
+            ShaperRun shaper_run(out);
+            if (shape_simple(utf8txt, *font, *metrics, shaper_run))
+                return shaper_run;
+        }
+    }
+
+    hb_feature_t features[3];
+    const auto features_n = shaping_features(options, features);
+    auto& scratch         = ShapingScratch::of_thread();
+    scratch.reset();
+    auto font_runs = create_font_runs(utf8txt, fonts, scratch);
+    ShaperRun shaper_run(out);
     shaper_run.items.reserve(font_runs.size());
+    Point pen_end { 0, 0 };
     for (auto& run : font_runs)
     {
+        // sizes share the face, hb_ft reads the glyphs at the active one
+        auto face_lock = lock_face_for_shaping(*run.font_ptr);
+        if (run.font_ptr->funcs == FontFuncs::FreeType)
+            FT_Activate_Size(run.font_ptr->size);
         {
-            STOPWATCH("shape");
-            hb_shape(run.font_ptr->unicode, run.buffer, nullptr, 0);
+            PROFILE_ZONE("hb_shape");
+            shape_plans::shape(run.font_ptr->unicode, run.buffer, features, features_n);
         }
 
         const auto glyphs_n = hb_buffer_get_length(run.buffer);
 
         {
-            STOPWATCH("copy info");
-            std::vector<hb_glyph_info_t> infos;
+            PROFILE_ZONE("copy_glyph_info");
+            std::pmr::vector<hb_glyph_info_t> infos(out);
             infos.reserve(glyphs_n);
             const auto infos_ptr = hb_buffer_get_glyph_infos(run.buffer, nullptr);
             for (int i = 0; i < glyphs_n; ++i)
                 infos.emplace_back(infos_ptr[i]);
 
-            std::vector<hb_glyph_position_t> positions;
+            std::pmr::vector<hb_glyph_position_t> positions(out);
             positions.reserve(glyphs_n);
             const auto pos_ptr = hb_buffer_get_glyph_positions(run.buffer, nullptr);
             for (int i = 0; i < glyphs_n; ++i)
@@ -487,13 +1225,27 @@ ShaperRun create_shapers(std::string& utf8txt, Font::Map& fonts)
             assert(infos.size() == positions.size());
 
             shaper_run.total_glyphs_n += glyphs_n;
-            shaper_run.items.emplace_back(RunItem { std::move(infos), std::move(positions), run.font_ptr });
+            auto& item = shaper_run.items.emplace_back(RunItem { std::move(infos), std::move(positions), run.font_ptr });
+            place_item(
+                item,
+                pen_end,
+                [&](size_t i, hb_glyph_extents_t& extents)
+                {
+                    const auto glyph = item.hb_info[i].codepoint;
+                    return hb_font_get_glyph_extents(run.font_ptr->unicode, glyph, &extents);
+                }
+            );
+            shaper_run.bounds.expand(item.bounds);
         }
-
-        hb_buffer_destroy(run.buffer);
     }
 
     return shaper_run;
 }
 
+// the shaped run on the heap, to keep
+ShaperRun create_shapers(std::string& utf8txt, Font::Map& fonts)
+{
+    return create_shapers_in(utf8txt, fonts, std::pmr::get_default_resource());
+}
+
 } // namespace typesetting
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <limits>
 #include <glm/glm.hpp>
 
 namespace gfx
@@ -17,10 +18,33 @@ Colour black { 0.0f, 0.0f, 0.0f };
 Colour white { 1.0f, 1.0f, 1.0f };
 } // namespace colours
 
+// p0 is the minimum corner and p1 the maximum, an empty box is inverted
 struct Aabb
 {
-    Point p0;
-    Point p1;
+    Point p0 { std::numeric_limits<float>::max() };
+    Point p1 { std::numeric_limits<float>::lowest() };
+
+    bool empty() const { return p1.x < p0.x || p1.y < p0.y; }
+
+    void expand(const Aabb& other)
+    {
+        p0 = glm::min(p0, other.p0);
+        p1 = glm::max(p1, other.p1);
+    }
+
+    Aabb translated(Point d) const { return empty() ? *this : Aabb { p0 + d, p1 + d }; }
+
+    bool intersects(const Aabb& other) const
+    {
+        return !empty() && !other.empty() && p0.x <= other.p1.x && other.p0.x <= p1.x && p0.y <= other.p1.y
+            && other.p0.y <= p1.y;
+    }
+
+    bool contains(const Aabb& other) const
+    {
+        return !other.empty() && p0.x <= other.p0.x && other.p1.x <= p1.x && p0.y <= other.p0.y
+            && other.p1.y <= p1.y;
+    }
 };
 
 } // namespace gfx
\ No newline at end of file
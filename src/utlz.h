@@ -149,65 +149,4 @@ auto time_in_ms   = time_in_<std::chrono::milliseconds>;
 auto time_in_mcrs = time_in_<std::chrono::microseconds>;
 auto time_in_ns   = time_in_<std::chrono::nanoseconds>;
 
-namespace stopwatch
-{
-struct Measurement
-{
-    using Clock = std::chrono::high_resolution_clock;
-
-    Measurement(Clock::duration& _sum, int& _n)
-        : sum(_sum)
-    {
-        _n++;
-        then = Clock::now();
-    }
-
-    ~Measurement() { sum += Clock::now() - then; }
-
-    Clock::time_point then;
-    Clock::duration& sum;
-};
-
-struct Aggregate
-{
-    explicit Aggregate(std::string _label)
-        : label(std::move(_label))
-    {
-    }
-
-    ~Aggregate() { print_stats(); }
-
-    void print_stats() const
-    {
-        auto ticks_total = sum.count();
-        auto time_unit = metric_time_unit(Measurement::Clock::period::den);
-
-        std::stringstream total_in_units;
-        total_in_units << format_with_space(sum.count()) << " " << time_unit;
-
-        std::stringstream avg_in_units;
-        avg_in_units << format_with_space(float(sum.count()) / float(measurements)) << " " << time_unit;
-
-        // clang-format off
-        std::cout
-            << std::setw(15) << label
-            << std::setw(6) << " - total: " << std::setw(15) << total_in_units.str()
-            << std::setw(8) << " avg: "     << std::setw(15) << avg_in_units.str()
-            << "\n";
-        // clang-format on
-    }
-
-    Measurement::Clock::duration sum { 0 };
-    std::string label;
-    int measurements = 0;
-};
-} // namespace stopwatch
-#ifndef STOPWATCH
-    #define STOPWATCH(label)                                          \
-        static utlz::stopwatch::Aggregate stopwatch_aggregate(label); \
-        utlz::stopwatch::Measurement stopwatch_measurement(           \
-            stopwatch_aggregate.sum,                                  \
-            stopwatch_aggregate.measurements                          \
-        );
-#endif
 } // namespace utlz
\ No newline at end of file
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cmath>
+#include <cstdint>
+#include <glad/glad.h>
+
+#include "spec.h"
+#include "types.h"
+
+namespace typesetting
+{
+
+// A glyph placed on the screen: the rectangle in pixels and its region in the atlas in texels
+struct GlyphQuad
+{
+    float x;
+    float y;
+    float w;
+    float h;
+    int tex_x;
+    int tex_y;
+    int tex_w;
+    int tex_h;
+    int layer; // atlas page
+};
+
+enum class VertexFormatId
+{
+    Triangles,
+    CompactTriangles,
+    Instances,
+    count
+};
+
+// Reference format: two triangles per glyph with float positions and texture coordinates
+struct VertexDataFormat
+{
+    using base_t = float;
+    base_t data[spec::vertex_data::triangle_points_n][spec::vertex_data::pos_points_n];
+};
+
+// Two triangles per glyph like VertexDataFormat in half the size: positions in 1/4 pixels and
+// texture coordinates normalized to 16 bits
+struct CompactVertexFormat
+{
+    struct Vertex
+    {
+        int16_t x;
+        int16_t y;
+        uint16_t u;
+        uint16_t v;
+    };
+    Vertex data[spec::vertex_data::triangle_points_n];
+};
+static_assert(sizeof(CompactVertexFormat) * 2 == sizeof(VertexDataFormat), "half of the reference format");
+
+// One record per glyph which the vertex shader expands into a quad
+struct GlyphInstance
+{
+    float x;            // bottom left corner in pixels
+    float y;            //
+    uint16_t w;         // size in 1/8 pixels
+    uint16_t h;         //
+    uint16_t tex[4];    // atlas region in texels: x, y, w, h
+    uint8_t colour[3];  // rgb
+    uint8_t layer;      // atlas page
+};
+static_assert(sizeof(GlyphInstance) == 24, "keep the glyph instances compact");
+
+// Vertex formats specialize the layout for their attributes, shaders, draw call and emission
+template <typename VertexDataType>
+struct VertexLayout;
+
+template <>
+struct VertexLayout<VertexDataFormat>
+{
+    static constexpr VertexFormatId id     = VertexFormatId::Triangles;
+    static constexpr bool per_glyph_colour = false;
+
+    static constexpr const char* vertex_shader = R"SHADER_INPUT(
+#version 330 core
+layout (location = 0) in vec4 vertex; // pos, tex
+out vec2 TexCoords;
+
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * vec4(vertex.xy, 0.0, 1.0);
+    TexCoords = vertex.zw;
+}
+)SHADER_INPUT";
+
+    static constexpr const char* fragment_shader = R"SHADER_INPUT(
+#version 330 core
+in vec2 TexCoords;
+out vec4 color;
+
+uniform sampler2DArray text;
+uniform vec3 textColor;
+uniform int layer;
+
+void main()
+{
+    float y = texture(text, vec3(TexCoords, layer)).r;
+    if (y < 0.5)
+        discard;
+    y *= 1.45;
+    y = 1.0 / (1.0 + exp(-20.0 * (y - 0.76)));
+
+    vec4 sampled = vec4(1.0, 1.0, 1.0, y);
+    color = vec4(textColor, 1.0) * sampled;
+}
+)SHADER_INPUT";
+
+    // offset of the first record in the bound vertex buffer, returns the number of GL calls
+    static int set_attributes(GLintptr offset)
+    {
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(
+            0,
+            spec::vertex_data::pos_points_n,
+            GL_FLOAT,
+            GL_FALSE,
+            spec::vertex_data::pos_points_n * sizeof(VertexDataFormat::base_t),
+            (void*) offset
+        );
+        return 2;
+    }
+
+    static void draw(GLsizei records_n)
+    {
+        glDrawArrays(GL_TRIANGLES, 0, records_n * spec::vertex_data::triangle_points_n);
+    }
+
+    static bool fits(const GlyphQuad&) { return true; }
+
+    static VertexDataFormat make(const GlyphQuad& q, Colour)
+    {
+        const float tex_x = q.tex_x / (float) spec::atlas_texture_w;
+        const float tex_y = q.tex_y / (float) spec::atlas_texture_h;
+        const float tex_w = q.tex_w / (float) spec::atlas_texture_w;
+        const float tex_h = q.tex_h / (float) spec::atlas_texture_h;
+
+        return { { { q.x, q.y + q.h, tex_x, tex_y },
+                   { q.x, q.y, tex_x, tex_y + tex_h },
+                   { q.x + q.w, q.y, tex_x + tex_w, tex_y + tex_h },
+
+                   { q.x, q.y + q.h, tex_x, tex_y },
+                   { q.x + q.w, q.y, tex_x + tex_w, tex_y + tex_h },
+                   { q.x + q.w, q.y + q.h, tex_x + tex_w, tex_y } } };
+    }
+};
+
+template <>
+struct VertexLayout<CompactVertexFormat>
+{
+    static constexpr VertexFormatId id     = VertexFormatId::CompactTriangles;
+    static constexpr bool per_glyph_colour = false;
+
+    static constexpr const char* vertex_shader = R"SHADER_INPUT(
+#version 330 core
+layout (location = 0) in vec2 position; // 1/4 pixels
+layout (location = 1) in vec2 tex;      // normalized
+out vec2 TexCoords;
+
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * vec4(position * 0.25, 0.0, 1.0);
+    TexCoords = tex;
+}
+)SHADER_INPUT";
+
+    static constexpr const char* fragment_shader = VertexLayout<VertexDataFormat>::fragment_shader;
+
+    static int set_attributes(GLintptr offset)
+    {
+        constexpr GLsizei stride = sizeof(CompactVertexFormat::Vertex);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, stride, (void*) (offset + offsetof(CompactVertexFormat::Vertex, x)));
+
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*) (offset + offsetof(CompactVertexFormat::Vertex, u)));
+        return 4;
+    }
+
+    static void draw(GLsizei records_n)
+    {
+        glDrawArrays(GL_TRIANGLES, 0, records_n * spec::vertex_data::triangle_points_n);
+    }
+
+    // 1/4 pixels in 16 bits reach 8191.75 pixels from the origin
+    static constexpr float max_position = 32767 / 4.0f;
+
+    // Quads reaching further would be squashed against the limit, they're culled instead. They
+    // can only be partly in the clip when the framebuffer is larger than the positions reach.
+    static bool fits(const GlyphQuad& q)
+    {
+        return q.x >= -max_position && q.y >= -max_position && q.x + q.w <= max_position
+            && q.y + q.h <= max_position;
+    }
+
+    static CompactVertexFormat make(const GlyphQuad& q, Colour)
+    {
+        assert(fits(q));
+        // the quad corners are rounded once, so that neighbouring glyphs don't open gaps
+        auto pos = [](float value) { return (int16_t) std::lround(value * 4.0f); };
+        auto u   = [](int texels) { return (uint16_t) ((texels * 65535 + spec::atlas_texture_w / 2) / spec::atlas_texture_w); };
+        auto v   = [](int texels) { return (uint16_t) ((texels * 65535 + spec::atlas_texture_h / 2) / spec::atlas_texture_h); };
+
+        const int16_t x0 = pos(q.x), x1 = pos(q.x + q.w);
+        const int16_t y0 = pos(q.y), y1 = pos(q.y + q.h);
+        const uint16_t u0 = u(q.tex_x), u1 = u(q.tex_x + q.tex_w);
+        const uint16_t v0 = v(q.tex_y), v1 = v(q.tex_y + q.tex_h);
+
+        return { { { x0, y1, u0, v0 },
+                   { x0, y0, u0, v1 },
+                   { x1, y0, u1, v1 },
+
+                   { x0, y1, u0, v0 },
+                   { x1, y0, u1, v1 },
+                   { x1, y1, u1, v0 } } };
+    }
+};
+
+template <>
+struct VertexLayout<GlyphInstance>
+{
+    static constexpr VertexFormatId id     = VertexFormatId::Instances;
+    static constexpr bool per_glyph_colour = true;
+
+    // the corners of the quad come from the vertex id of a 4 vertex triangle strip
+    static constexpr const char* vertex_shader = R"SHADER_INPUT(
+#version 330 core
+layout (location = 0) in vec2 origin;   // bottom left, pixels
+layout (location = 1) in vec2 size;     // 1/8 pixels
+layout (location = 2) in vec4 tex_rect; // texels
+layout (location = 3) in vec3 colour;
+layout (location = 4) in float layer;
+out vec3 TexCoords; // with the layer
+out vec3 TextColour;
+
+uniform mat4 projection;
+uniform vec2 atlas_size;
+uniform vec2 translation; // of retained text blocks
+
+void main()
+{
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    gl_Position = projection * vec4(translation + origin + corner * size * 0.125, 0.0, 1.0);
+    // atlas rows run top down while the quad is built bottom up
+    TexCoords = vec3((tex_rect.xy + vec2(corner.x, 1.0 - corner.y) * tex_rect.zw) / atlas_size, layer);
+    TextColour = colour.rgb;
+}
+)SHADER_INPUT";
+
+    static constexpr const char* fragment_shader = R"SHADER_INPUT(
+#version 330 core
+in vec3 TexCoords;
+in vec3 TextColour;
+out vec4 color;
+
+uniform sampler2DArray text;
+
+void main()
+{
+    float y = texture(text, TexCoords).r;
+    if (y < 0.5)
+        discard;
+    y *= 1.45;
+    y = 1.0 / (1.0 + exp(-20.0 * (y - 0.76)));
+
+    vec4 sampled = vec4(1.0, 1.0, 1.0, y);
+    color = vec4(TextColour, 1.0) * sampled;
+}
+)SHADER_INPUT";
+
+    // there's no base instance in GL 3.3, so the attributes point to the first record
+    static int set_attributes(GLintptr offset)
+    {
+        constexpr GLsizei stride = sizeof(GlyphInstance);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*) (offset + offsetof(GlyphInstance, x)));
+        glVertexAttribDivisor(0, 1);
+
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*) (offset + offsetof(GlyphInstance, w)));
+        glVertexAttribDivisor(1, 1);
+
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*) (offset + offsetof(GlyphInstance, tex)));
+        glVertexAttribDivisor(2, 1);
+
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*) (offset + offsetof(GlyphInstance, colour)));
+        glVertexAttribDivisor(3, 1);
+
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 1, GL_UNSIGNED_BYTE, GL_FALSE, stride, (void*) (offset + offsetof(GlyphInstance, layer)));
+        glVertexAttribDivisor(4, 1);
+        return 15;
+    }
+
+    static void draw(GLsizei records_n) { glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, records_n); }
+
+    static bool fits(const GlyphQuad&) { return true; }
+
+    static GlyphInstance make(const GlyphQuad& q, Colour c)
+    {
+        auto to_byte = [](float value) { return (uint8_t) (std::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f); };
+
+        return { q.x,
+                 q.y,
+                 (uint16_t) (q.w * 8.0f + 0.5f),
+                 (uint16_t) (q.h * 8.0f + 0.5f),
+                 { (uint16_t) q.tex_x, (uint16_t) q.tex_y, (uint16_t) q.tex_w, (uint16_t) q.tex_h },
+                 { to_byte(c.x), to_byte(c.y), to_byte(c.z) },
+                 (uint8_t) q.layer };
+    }
+};
+
+} // namespace typesetting